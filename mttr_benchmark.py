@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+#
+# Copyright 2021 IBM
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+# Measures the mean time to recovery (MTTR) of TDS after its process is killed:
+# the time from the kill until the restarted instance classifies its first frame.
+# It compares relaunching ./tds from scratch (as a restart script would) against the
+# supervisor mode (./tds -s), which replaces the killed worker by forking a copy
+# of the process that already holds the loaded model.
+
+import subprocess
+import time
+import os
+import re
+import signal
+import sys
+
+
+POLL = 0.01     # seconds
+TIMEOUT = 300   # seconds to wait for a restarted instance to classify a frame
+READY = 'First frame classified'
+
+
+def wait_for(path, pattern, start=0):
+    # Wait until pattern shows up in the file after offset start; returns the match
+    deadline = time.time() + TIMEOUT
+    while (time.time() < deadline):
+        if (os.path.isfile(path)):
+            with open(path) as f:
+                f.seek(start)
+                match = re.search(pattern, f.read())
+            if (match):
+                return match
+        time.sleep(POLL)
+    print('ERROR: timed out waiting for "' + pattern + '" in ' + path)
+    sys.exit(-1)
+
+
+def relaunch_trials(config, trials, base_dir):
+    times = []
+    for i in range(trials + 1):
+        run_dir = base_dir + '/relaunch_' + str(i)
+        os.makedirs(run_dir)
+        output = run_dir + '/tds.out'
+        cmd = ['./tds', '-c', config, '-d', run_dir, '-l', 'predictions.out', '-i', str(i)]
+        proc = subprocess.Popen(cmd, stdout=open(output, 'w'), stderr=subprocess.STDOUT)
+        wait_for(output, READY)
+        if (i > 0):
+            times.append(time.time() - killed)
+        if (i < trials):
+            proc.send_signal(signal.SIGKILL)
+            killed = time.time()
+            proc.wait()
+        else:
+            proc.send_signal(signal.SIGINT)
+            proc.wait()
+    return times
+
+
+def supervisor_trials(config, trials, base_dir):
+    times = []
+    output = base_dir + '/supervisor.out'
+    cmd = ['./tds', '-s', '-c', config, '-d', base_dir, '-l', 'predictions.out']
+    proc = subprocess.Popen(cmd, stdout=open(output, 'w'), stderr=subprocess.STDOUT)
+    offset = 0
+    for i in range(trials + 1):
+        match = wait_for(output, r'Worker \d+ started \(pid (\d+)\) in (\S+)\n', offset)
+        offset += match.end()
+        wait_for(match.group(2) + '/tds.out', READY)
+        if (i > 0):
+            times.append(time.time() - killed)
+        if (i < trials):
+            os.kill(int(match.group(1)), signal.SIGKILL)
+            killed = time.time()
+    proc.send_signal(signal.SIGINT)
+    proc.wait()
+    return times
+
+
+def report(name, times):
+    times = sorted(times)
+    mean = sum(times) / len(times)
+    median = times[len(times) // 2] if len(times) % 2 else (times[len(times) // 2 - 1] + times[len(times) // 2]) / 2
+    print('%-12s %d restarts, MTTR mean %.3f sec, median %.3f sec, min %.3f sec, max %.3f sec' %
+          (name, len(times), mean, median, times[0], times[-1]))
+    return mean
+
+
+if (len(sys.argv) < 2 or len(sys.argv) > 3):
+    print('Usage: ' + sys.argv[0] + ' <JSON config file> [trials]')
+    sys.exit(-1)
+
+trials = int(sys.argv[2]) if len(sys.argv) == 3 else 5
+base_dir = time.strftime('mttr_y%Ym%md%d_h%Hm%Ms%S')
+os.makedirs(base_dir)
+
+relaunch = report('Relaunch:', relaunch_trials(sys.argv[1], trials, base_dir))
+supervised = report('Supervisor:', supervisor_trials(sys.argv[1], trials, base_dir))
+print('Supervisor speedup: %.1fx' % (relaunch / supervised))
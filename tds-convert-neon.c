@@ -0,0 +1,73 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+// NEON conversion kernel. It lives in its own file because on 32-bit ARM it is the only code
+// built with -mfpu=neon-vfpv4 (see Makefile.rpi); the rest of TDS must still run on cores
+// without NEON. On aarch64 NEON is always there and no flag is needed.
+
+#include <arm_neon.h>
+#include "tds-convert.h"
+
+
+static inline float32x4_t normalize(uint32x4_t v)
+{
+  float32x4_t x = vcvtq_f32_u32(v);
+#if defined(__aarch64__)
+  return vdivq_f32(x, vdupq_n_f32(255.f));
+#else
+  // ARMv7 NEON has no division: refine the reciprocal estimate with the exact (fused)
+  // residual, which rounds to the same value as x/255.f for every byte value
+  const float32x4_t d = vdupq_n_f32(255.f);
+  const float32x4_t r = vdupq_n_f32(1.f/255.f);
+  float32x4_t q = vmulq_f32(x, r);
+  float32x4_t e = vfmsq_f32(x, q, d);
+  return vfmaq_f32(q, e, r);
+#endif
+}
+
+
+static inline void store16(float *dst, uint8x16_t v)
+{
+  uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+  uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+  vst1q_f32(dst,      normalize(vmovl_u16(vget_low_u16(lo))));
+  vst1q_f32(dst + 4,  normalize(vmovl_u16(vget_high_u16(lo))));
+  vst1q_f32(dst + 8,  normalize(vmovl_u16(vget_low_u16(hi))));
+  vst1q_f32(dst + 12, normalize(vmovl_u16(vget_high_u16(hi))));
+}
+
+
+void convert_rgb24_to_planar_neon(const unsigned char *src, float *dst, int npixels)
+{
+  float *r = dst;
+  float *g = dst + npixels;
+  float *b = dst + 2*npixels;
+  int i;
+
+  for (i = 0; i + 16 <= npixels; i += 16) {
+    // vld3 deinterleaves 16 rgb24 pixels into one register per channel
+    uint8x16x3_t px = vld3q_u8(src + 3*i);
+    store16(r+i, px.val[0]);
+    store16(g+i, px.val[1]);
+    store16(b+i, px.val[2]);
+  }
+  for (; i < npixels; i++) {
+    r[i] = src[3*i]   / 255.f;
+    g[i] = src[3*i+1] / 255.f;
+    b[i] = src[3*i+2] / 255.f;
+  }
+}
@@ -0,0 +1,305 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tds-convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#if defined(NEON) && defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CHECK_PIXELS 1027  // Covers all 256 byte values and a partial SIMD block
+
+static convert_fn_t convert_fn   = convert_rgb24_to_planar_scalar;
+static const char  *convert_name = "scalar";
+
+
+// Reference kernel. Dividing in single precision gives the same result as the original
+// (float)x/255. conversion for every byte value
+void convert_rgb24_to_planar_scalar(const unsigned char *src, float *dst, int npixels)
+{
+  float *r = dst;
+  float *g = dst + npixels;
+  float *b = dst + 2*npixels;
+  int i;
+
+  for (i = 0; i < npixels; i++) {
+    r[i] = src[3*i]   / 255.f;
+    g[i] = src[3*i+1] / 255.f;
+    b[i] = src[3*i+2] / 255.f;
+  }
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// Shuffle masks that gather one channel of 16 rgb24 pixels (48 bytes loaded as three
+// 16-byte vectors) into a single vector; -1 zeroes the byte so the three parts can be OR'ed
+#define DEINTERLEAVE_MASKS                                                                        \
+  const __m128i r0 = _mm_setr_epi8( 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);              \
+  const __m128i r1 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14,-1,-1,-1,-1,-1);              \
+  const __m128i r2 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 1, 4, 7,10,13);              \
+  const __m128i g0 = _mm_setr_epi8( 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);              \
+  const __m128i g1 = _mm_setr_epi8(-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1);              \
+  const __m128i g2 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14);              \
+  const __m128i b0 = _mm_setr_epi8( 2, 5, 8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);              \
+  const __m128i b1 = _mm_setr_epi8(-1,-1,-1,-1,-1, 1, 4, 7,10,13,-1,-1,-1,-1,-1,-1);              \
+  const __m128i b2 = _mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 0, 3, 6, 9,12,15)
+
+#define DEINTERLEAVE(v0, v1, v2, m0, m1, m2) \
+  _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, m0), _mm_shuffle_epi8(v1, m1)), _mm_shuffle_epi8(v2, m2))
+
+
+__attribute__((target("ssse3,sse4.1")))
+static inline void store16_sse41(float *dst, __m128i v, __m128 scale)
+{
+  int k;
+  for (k = 0; k < 4; k++) {
+    __m128 f = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v));
+    _mm_storeu_ps(dst + 4*k, _mm_div_ps(f, scale));
+    v = _mm_srli_si128(v, 4);
+  }
+}
+
+
+__attribute__((target("ssse3,sse4.1")))
+static void convert_rgb24_to_planar_sse41(const unsigned char *src, float *dst, int npixels)
+{
+  DEINTERLEAVE_MASKS;
+  const __m128 scale = _mm_set1_ps(255.f);
+  float *r = dst;
+  float *g = dst + npixels;
+  float *b = dst + 2*npixels;
+  int i;
+
+  for (i = 0; i + 16 <= npixels; i += 16) {
+    const unsigned char *s = src + 3*i;
+    __m128i v0 = _mm_loadu_si128((const __m128i *)s);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(s+16));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(s+32));
+    store16_sse41(r+i, DEINTERLEAVE(v0, v1, v2, r0, r1, r2), scale);
+    store16_sse41(g+i, DEINTERLEAVE(v0, v1, v2, g0, g1, g2), scale);
+    store16_sse41(b+i, DEINTERLEAVE(v0, v1, v2, b0, b1, b2), scale);
+  }
+  for (; i < npixels; i++) {
+    r[i] = src[3*i]   / 255.f;
+    g[i] = src[3*i+1] / 255.f;
+    b[i] = src[3*i+2] / 255.f;
+  }
+}
+
+
+__attribute__((target("avx2")))
+static inline void store16_avx2(float *dst, __m128i v, __m256 scale)
+{
+  __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+  __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+  _mm256_storeu_ps(dst,     _mm256_div_ps(lo, scale));
+  _mm256_storeu_ps(dst + 8, _mm256_div_ps(hi, scale));
+}
+
+
+__attribute__((target("avx2")))
+static void convert_rgb24_to_planar_avx2(const unsigned char *src, float *dst, int npixels)
+{
+  DEINTERLEAVE_MASKS;
+  const __m256 scale = _mm256_set1_ps(255.f);
+  float *r = dst;
+  float *g = dst + npixels;
+  float *b = dst + 2*npixels;
+  int i;
+
+  for (i = 0; i + 16 <= npixels; i += 16) {
+    const unsigned char *s = src + 3*i;
+    __m128i v0 = _mm_loadu_si128((const __m128i *)s);
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(s+16));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(s+32));
+    store16_avx2(r+i, DEINTERLEAVE(v0, v1, v2, r0, r1, r2), scale);
+    store16_avx2(g+i, DEINTERLEAVE(v0, v1, v2, g0, g1, g2), scale);
+    store16_avx2(b+i, DEINTERLEAVE(v0, v1, v2, b0, b1, b2), scale);
+  }
+  for (; i < npixels; i++) {
+    r[i] = src[3*i]   / 255.f;
+    g[i] = src[3*i+1] / 255.f;
+    b[i] = src[3*i+2] / 255.f;
+  }
+}
+
+#endif
+
+
+// Runs a kernel and the scalar reference on the same synthetic frame and compares the bits
+static int check_kernel(convert_fn_t fn)
+{
+  unsigned char *src = malloc(3*CHECK_PIXELS);
+  float *ref = malloc(sizeof(float)*3*CHECK_PIXELS);
+  float *out = malloc(sizeof(float)*3*CHECK_PIXELS);
+  int i, status;
+
+  for (i = 0; i < 3*CHECK_PIXELS; i++)
+    src[i] = (unsigned char)(i*7 + 3);
+  convert_rgb24_to_planar_scalar(src, ref, CHECK_PIXELS);
+  fn(src, out, CHECK_PIXELS);
+  status = memcmp(ref, out, sizeof(float)*3*CHECK_PIXELS) == 0 ? 0 : -1;
+
+  free(src);
+  free(ref);
+  free(out);
+  return status;
+}
+
+
+static void try_kernel(convert_fn_t fn, const char *name)
+{
+  if (check_kernel(fn) != 0) {
+    printf("Warning: %s conversion kernel does not match the scalar kernel; not using it\n", name);
+    return;
+  }
+  convert_fn   = fn;
+  convert_name = name;
+}
+
+
+int convert_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    try_kernel(convert_rgb24_to_planar_avx2, "avx2");
+  else if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1"))
+    try_kernel(convert_rgb24_to_planar_sse41, "sse4.1");
+#endif
+#ifdef NEON
+#if defined(__arm__)
+  unsigned long hwcap = getauxval(AT_HWCAP);
+  if ((hwcap & HWCAP_NEON) && (hwcap & HWCAP_VFPv4))
+    try_kernel(convert_rgb24_to_planar_neon, "neon");
+#else
+  try_kernel(convert_rgb24_to_planar_neon, "neon");
+#endif
+#endif
+
+  return 0;
+}
+
+
+const char *convert_kernel_name(void)
+{
+  return convert_name;
+}
+
+
+void convert_rgb24_to_planar(const unsigned char *src, float *dst, int npixels)
+{
+  convert_fn(src, dst, npixels);
+}
+
+
+void convert_rgb24_region_to_image(const unsigned char *src, int stride, image im, float *row)
+{
+  int y;
+  for (y = 0; y < im.h; y++) {
+    convert_fn(src + 3*(size_t)stride*y, row, im.w);
+    memcpy(im.data + y*im.w, row, sizeof(float)*im.w);
+    memcpy(im.data + (im.h + y)*im.w, row + im.w, sizeof(float)*im.w);
+    memcpy(im.data + (2*im.h + y)*im.w, row + 2*im.w, sizeof(float)*im.w);
+  }
+}
+
+
+void letterbox_size(int w, int h, int box_w, int box_h, int *new_w, int *new_h)
+{
+  if (((float)box_w/w) < ((float)box_h/h)) {
+    *new_w = box_w;
+    *new_h = (h * box_w)/w;
+  } else {
+    *new_h = box_h;
+    *new_w = (w * box_h)/h;
+  }
+}
+
+
+void letterbox_image_into(image im, float *part, image boxed)
+{
+  int w = boxed.w;
+  int h = boxed.h;
+  int new_w, new_h;
+  int r, c, k;
+
+  letterbox_size(im.w, im.h, w, h, &new_w, &new_h);
+  int dx = (w-new_w)/2;
+  int dy = (h-new_h)/2;
+
+  for (k = 0; k < boxed.w*boxed.h*boxed.c; ++k)
+    boxed.data[k] = .5;
+
+  // Same two-pass bilinear interpolation as resize_image(), with the second pass writing
+  // straight into the box instead of going through a resized image and embed_image()
+  float w_scale = (float)(im.w - 1) / (new_w - 1);
+  float h_scale = (float)(im.h - 1) / (new_h - 1);
+  for (k = 0; k < im.c; ++k) {
+    for (r = 0; r < im.h; ++r) {
+      float *src = im.data + (k*im.h + r)*im.w;
+      float *dst = part + (k*im.h + r)*new_w;
+      for (c = 0; c < new_w; ++c) {
+        if (c == new_w-1 || im.w == 1) {
+          dst[c] = src[im.w-1];
+        } else {
+          float sx = c*w_scale;
+          int ix = (int) sx;
+          float fx = sx - ix;
+          dst[c] = (1 - fx) * src[ix] + fx * src[ix+1];
+        }
+      }
+    }
+  }
+  for (k = 0; k < im.c; ++k) {
+    for (r = 0; r < new_h; ++r) {
+      float sy = r*h_scale;
+      int iy = (int) sy;
+      float fy = sy - iy;
+      float *dst = boxed.data + (k*h + dy + r)*w + dx;
+      float *src = part + (k*im.h + iy)*new_w;
+      for (c = 0; c < new_w; ++c)
+        dst[c] = (1-fy) * src[c];
+      if (r == new_h-1 || im.h == 1) continue;
+      src += new_w;
+      for (c = 0; c < new_w; ++c)
+        dst[c] += fy * src[c];
+    }
+  }
+}
+
+
+void embed_image_into(image im, image boxed)
+{
+  int dx = (boxed.w - im.w)/2;
+  int dy = (boxed.h - im.h)/2;
+  int r, k;
+
+  for (k = 0; k < boxed.w*boxed.h*boxed.c; ++k)
+    boxed.data[k] = .5;
+  for (k = 0; k < im.c; ++k)
+    for (r = 0; r < im.h; ++r)
+      memcpy(boxed.data + (k*boxed.h + dy + r)*boxed.w + dx, im.data + (k*im.h + r)*im.w, sizeof(float)*im.w);
+}
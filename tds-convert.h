@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_CONVERT_H
+#define TDS_CONVERT_H
+
+#include "darknet.h"
+
+// Conversion of packed rgb24 frames (as produced by ffmpeg) into Darknet's planar float
+// format (all R values, then all G, then all B), normalized to [0,1]. Every kernel
+// deinterleaves and normalizes in a single pass and produces the same bits as the scalar one.
+typedef void (*convert_fn_t)(const unsigned char *src, float *dst, int npixels);
+
+// Picks the fastest kernel supported by the CPU and checks it against the scalar kernel
+int  convert_init(void);
+const char *convert_kernel_name(void);
+void convert_rgb24_to_planar(const unsigned char *src, float *dst, int npixels);
+// Converts an im.w x im.h region of a frame, whose top-left pixel is src and whose rows are
+// stride pixels apart, into im. Goes row by row through row, scratch space of 3*im.w floats
+void convert_rgb24_region_to_image(const unsigned char *src, int stride, image im, float *row);
+
+// Size of a w x h picture letterboxed into box_w x box_h, computed exactly as letterbox_image()
+// (and Darknet's box correction) do, so boxes map back to the source frame
+void letterbox_size(int w, int h, int box_w, int box_h, int *new_w, int *new_h);
+
+// Darknet's letterbox_image() without allocations: im is resized (exactly like resize_image())
+// into the center of boxed. part is scratch space of at least boxed.w*im.h*im.c floats
+void letterbox_image_into(image im, float *part, image boxed);
+
+// Centers an image already scaled to its letterbox size (e.g. by ffmpeg) in boxed, filling the
+// rest like letterbox_image() does
+void embed_image_into(image im, image boxed);
+
+void convert_rgb24_to_planar_scalar(const unsigned char *src, float *dst, int npixels);
+#ifdef NEON
+void convert_rgb24_to_planar_neon(const unsigned char *src, float *dst, int npixels);
+#endif
+
+#endif
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include "tds-images.h"
+
+// A private copy of stb_image, from the Darknet tree (src/stb_image.h): Darknet's own loaders
+// exit on a file they cannot decode, and libdarknet does not promise to export stb_image
+#define STB_IMAGE_STATIC
+#define STB_IMAGE_IMPLEMENTATION
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "stb_image.h"
+#pragma GCC diagnostic pop
+
+// Formats stb_image decodes; directories are filtered by extension
+static const char *image_exts[] = {".jpg", ".jpeg", ".png", ".bmp", ".tga", ".ppm", ".pgm", NULL};
+
+
+static bool has_image_ext(const char *name)
+{
+  const char *ext = strrchr(name, '.');
+  int i;
+  if (ext == NULL)
+    return false;
+  for (i = 0; image_exts[i] != NULL; i++)
+    if (strcasecmp(ext, image_exts[i]) == 0)
+      return true;
+  return false;
+}
+
+
+static int add_path(image_list_t *list, int *capacity, const char *path)
+{
+  if (list->count == *capacity) {
+    *capacity = (*capacity == 0) ? 256 : 2*(*capacity);
+    char **paths = realloc(list->paths, sizeof(char *)*(*capacity));
+    if (paths == NULL)
+      return -1;
+    list->paths = paths;
+  }
+  list->paths[list->count] = strdup(path);
+  if (list->paths[list->count] == NULL)
+    return -1;
+  list->count++;
+  return 0;
+}
+
+
+static int compare_paths(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+static int load_directory(const char *dirname, image_list_t *list, int *capacity)
+{
+  char path[1024];
+  struct dirent *entry;
+  struct stat st;
+  DIR *dir = opendir(dirname);
+  if (dir == NULL)
+    return -1;
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.' || !has_image_ext(entry->d_name))
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dirname, entry->d_name);
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    if (add_path(list, capacity, path) != 0) {
+      closedir(dir);
+      return -1;
+    }
+  }
+  closedir(dir);
+
+  qsort(list->paths, list->count, sizeof(char *), compare_paths);
+  return 0;
+}
+
+
+static int load_glob(const char *pattern, image_list_t *list, int *capacity)
+{
+  glob_t g;
+  size_t i;
+  int status = glob(pattern, 0, NULL, &g);
+  if (status == GLOB_NOMATCH)
+    return 0;
+  if (status != 0)
+    return -1;
+  for (i = 0; i < g.gl_pathc; i++)
+    if (add_path(list, capacity, g.gl_pathv[i]) != 0) {
+      globfree(&g);
+      return -1;
+    }
+  globfree(&g);
+  return 0;
+}
+
+
+static int load_list_file(const char *filename, image_list_t *list, int *capacity)
+{
+  char line[1024];
+  FILE *f = fopen(filename, "r");
+  if (f == NULL)
+    return -1;
+
+  while (fgets(line, sizeof(line), f) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+    if (add_path(list, capacity, line) != 0) {
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+
+int image_list_load(const char *spec, image_list_t *list)
+{
+  struct stat st;
+  int capacity = 0;
+  int status;
+
+  list->paths = NULL;
+  list->count = 0;
+
+  if (stat(spec, &st) == 0 && S_ISDIR(st.st_mode))
+    status = load_directory(spec, list, &capacity);
+  else if (strpbrk(spec, "*?[") != NULL)
+    status = load_glob(spec, list, &capacity);
+  else
+    status = load_list_file(spec, list, &capacity);
+
+  if (status != 0) {
+    printf("ERROR: cannot list images from %s\n", spec);
+    image_list_free(list);
+    return -1;
+  }
+  return 0;
+}
+
+
+unsigned char *image_file_load(const char *path, int *w, int *h)
+{
+  int c;
+  return stbi_load(path, w, h, &c, 3);
+}
+
+
+void image_file_free(unsigned char *rgb)
+{
+  stbi_image_free(rgb);
+}
+
+
+void image_list_free(image_list_t *list)
+{
+  int i;
+  for (i = 0; i < list->count; i++)
+    free(list->paths[i]);
+  free(list->paths);
+  list->paths = NULL;
+  list->count = 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_IMAGES_H
+#define TDS_IMAGES_H
+
+// List of image files to classify in image-directory mode. spec is either a directory (all the
+// image files in it, sorted by name), a glob pattern (e.g. "archive/*/*.jpg") or a text file with
+// one image path per line (empty lines and lines starting with '#' are ignored).
+typedef struct {
+  char **paths;
+  int count;
+} image_list_t;
+
+int  image_list_load(const char *spec, image_list_t *list);
+void image_list_free(image_list_t *list);
+// Decodes an image file as rgb24 (NULL if it cannot be read or decoded, instead of exiting like
+// Darknet's load_image_color()); the pixels are released with image_file_free()
+unsigned char *image_file_load(const char *path, int *w, int *h);
+void image_file_free(unsigned char *rgb);
+
+#endif
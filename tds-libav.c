@@ -0,0 +1,366 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tds-libav.h"
+#include "tds-pool.h"
+#include "tds-convert.h"
+
+#ifdef LIBAV
+
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <libavutil/imgutils.h>
+
+struct libav_input {
+  char *url;
+  AVFormatContext *fmt;
+  AVCodecContext *dec;
+  struct SwsContext *sws;
+  AVPacket *pkt;
+  AVFrame *frame;
+  int stream;
+  dim_t fit;               // Frames are scaled to fit in this size (0x0: full resolution)
+  double interval;        // Stream time between returned frames (seconds)
+  double last_time;       // Stream time of the last returned frame (-1 before the first one)
+  skip_mode_t skip;
+  bool key_only;          // Only keyframes are sent to the decoder
+  double last_key;        // Stream time of the last keyframe (-1 before the first one)
+  bool flushing;          // End of input reached; draining the decoder
+  bool draining_key;      // Draining the decoder after a sampled keyframe
+  double stall_timeout;   // Seconds without packets after which a blocked read gives up (0: never)
+  double last_packet;     // When the last packet arrived (or the current read or open started)
+  bool stalled;           // The last read gave up after stall_timeout
+  volatile bool stop;
+};
+
+
+// Polled by libavformat while it blocks on I/O. A stream that stopped sending data makes the
+// blocked call fail, so that the camera can be reconnected
+static int interrupt_cb(void *arg)
+{
+  libav_input_t *av = arg;
+  if (av->stall_timeout > 0 && what_time_is_it_now() - av->last_packet > av->stall_timeout)
+    av->stalled = true;
+  return av->stop || exit_loop || av->stalled;
+}
+
+
+static void close_stream(libav_input_t *av)
+{
+  avcodec_free_context(&av->dec);
+  avformat_close_input(&av->fmt);
+}
+
+
+// Opens the input and its decoder, and resets the sampling state. On failure the input may be
+// partly open, which open_stream() undoes
+static int try_open_stream(libav_input_t *av)
+{
+  const char *url = av->url;
+
+  av->last_time    = -1;
+  av->key_only     = (av->skip == SKIP_NOKEY);
+  av->last_key     = -1;
+  av->flushing     = false;
+  av->draining_key = false;
+  av->last_packet  = what_time_is_it_now();
+  av->stalled      = false;
+
+  av->fmt = avformat_alloc_context();
+  if (av->fmt == NULL)
+    return -1;
+  av->fmt->interrupt_callback.callback = interrupt_cb;
+  av->fmt->interrupt_callback.opaque   = av;
+  // Low delay: no buffering ahead of the packets we read, no frame reordering delay in the decoder
+  av->fmt->flags |= AVFMT_FLAG_NOBUFFER;
+  if (avformat_open_input(&av->fmt, url, NULL, NULL) < 0) {
+    printf("ERROR: libav cannot open %s\n", url);
+    return -1;
+  }
+  if (avformat_find_stream_info(av->fmt, NULL) < 0) {
+    printf("ERROR: libav cannot find stream information for %s\n", url);
+    return -1;
+  }
+
+  av->stream = av_find_best_stream(av->fmt, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  if (av->stream < 0) {
+    printf("ERROR: %s has no video stream\n", url);
+    return -1;
+  }
+  AVCodecParameters *par = av->fmt->streams[av->stream]->codecpar;
+  const AVCodec *codec = avcodec_find_decoder(par->codec_id);
+  if (codec == NULL) {
+    printf("ERROR: libav has no decoder for %s\n", url);
+    return -1;
+  }
+  av->dec = avcodec_alloc_context3(codec);
+  if (av->dec == NULL || avcodec_parameters_to_context(av->dec, par) < 0) {
+    printf("ERROR: libav cannot open the decoder for %s\n", url);
+    return -1;
+  }
+  av->dec->flags |= AV_CODEC_FLAG_LOW_DELAY;
+  if (av->skip == SKIP_NONREF)
+    av->dec->skip_frame = AVDISCARD_NONREF;
+  else if (av->skip == SKIP_NOKEY)
+    av->dec->skip_frame = AVDISCARD_NONKEY;
+  if (avcodec_open2(av->dec, codec, NULL) < 0) {
+    printf("ERROR: libav cannot open the decoder for %s\n", url);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// The handle is either fully open or closed (fmt and dec are NULL), never half-open
+static int open_stream(libav_input_t *av)
+{
+  if (try_open_stream(av) != 0) {
+    close_stream(av);
+    return -1;
+  }
+  return 0;
+}
+
+
+libav_input_t *libav_open(const char *url, dim_t fit, double interval, skip_mode_t skip, double stall_timeout)
+{
+  libav_input_t *av = calloc(1, sizeof(libav_input_t));
+  if (av == NULL)
+    return NULL;
+  av->fit      = fit;
+  av->interval = interval;
+  av->skip     = skip;
+  av->stall_timeout = stall_timeout;
+
+  av->url   = strdup(url);
+  av->pkt   = av_packet_alloc();
+  av->frame = av_frame_alloc();
+  if (av->url == NULL || av->pkt == NULL || av->frame == NULL) {
+    libav_close(av);
+    return NULL;
+  }
+  // A stream that cannot be opened yet stays closed, and libav_restart() tries again
+  open_stream(av);
+
+  return av;
+}
+
+
+int libav_restart(libav_input_t *av)
+{
+  close_stream(av);
+  if (av->stop)
+    return -1;
+  return open_stream(av);
+}
+
+
+// Converts the decoded picture to rgb24 into the frame, growing its buffer if the stream's size
+// changed; the scaler is (re)created whenever the size or pixel format of the stream changes.
+// Returns the number of bytes written
+static size_t convert_frame(libav_input_t *av, frame_t *frame)
+{
+  AVFrame *f = av->frame;
+  int w = f->width;
+  int h = f->height;
+
+  if (av->fit.width > 0)
+    letterbox_size(f->width, f->height, av->fit.width, av->fit.height, &w, &h);
+  if (frame_reserve(frame, w*h*3) != 0)
+    return 0;
+  av->sws = sws_getCachedContext(av->sws, f->width, f->height, f->format,
+                                 w, h, AV_PIX_FMT_RGB24, SWS_BILINEAR, NULL, NULL, NULL);
+  if (av->sws == NULL)
+    return 0;
+
+  uint8_t *dst[4]   = {frame->data, NULL, NULL, NULL};
+  int dst_stride[4] = {w*3, 0, 0, 0};
+  sws_scale(av->sws, (const uint8_t * const *)f->data, f->linesize, 0, f->height, dst, dst_stride);
+  frame->width  = w;
+  frame->height = h;
+
+  return w*h*3;
+}
+
+
+// Stream time in seconds of a timestamp (-1 if unknown)
+static double stream_time(libav_input_t *av, int64_t ts)
+{
+  AVStream *st = av->fmt->streams[av->stream];
+  if (ts == AV_NOPTS_VALUE)
+    return -1;
+  if (st->start_time != AV_NOPTS_VALUE)
+    ts -= st->start_time;
+  return ts*av_q2d(st->time_base);
+}
+
+
+// Whether a frame at stream time t is due: interval seconds have passed since the last returned
+// frame (a jump backwards, e.g. a timestamp reset, restarts the count)
+static bool is_due(libav_input_t *av, double t)
+{
+  return av->last_time < 0 || t < 0 || t < av->last_time || t - av->last_time >= av->interval;
+}
+
+
+// Decides whether a packet goes to the decoder. In keyframe-only mode, keyframes that are not
+// due are dropped too, so only the frames we return are ever decoded. In auto mode, keyframe-only
+// decoding is used while keyframes come at least once per sample interval (the GOP is shorter
+// than the interval); otherwise every frame must be decoded to reach the sampling points.
+static bool want_packet(libav_input_t *av, AVPacket *pkt)
+{
+  bool key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+  double t = stream_time(av, pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts);
+
+  if (key && av->skip == SKIP_AUTO) {
+    if (av->last_key >= 0 && t > av->last_key)
+      av->key_only = (t - av->last_key) <= av->interval;
+    av->last_key = t;
+  }
+  if (!av->key_only)
+    return true;
+  return key && is_due(av, t);
+}
+
+
+size_t libav_read_frame(libav_input_t *av, frame_t *frame)
+{
+  size_t size;
+  int ret;
+
+  if (av->fmt == NULL || av->dec == NULL)
+    // Not open (the last open failed)
+    return 0;
+  // Time spent waiting for a free frame before this call is not a stall
+  av->last_packet = what_time_is_it_now();
+  av->stalled     = false;
+  while (!av->stop) {
+    ret = avcodec_receive_frame(av->dec, av->frame);
+    if (ret == 0) {
+      double t = stream_time(av, av->frame->best_effort_timestamp);
+      if (!is_due(av, t)) {
+        av_frame_unref(av->frame);
+        continue;
+      }
+      av->last_time = t >= 0 ? t : av->last_time + av->interval;
+      size = convert_frame(av, frame);
+      av_frame_unref(av->frame);
+      return size;
+    }
+    if (ret == AVERROR_EOF && av->draining_key && !av->flushing) {
+      avcodec_flush_buffers(av->dec);
+      av->draining_key = false;
+      continue;
+    }
+    if (ret != AVERROR(EAGAIN))
+      // End of stream (after draining) or decoding error
+      return 0;
+
+    ret = av_read_frame(av->fmt, av->pkt);
+    if (ret < 0 && av->stalled)
+      return 0;
+    if (ret < 0) {
+      if (av->flushing)
+        return 0;
+      // Drain the frames still buffered in the decoder
+      av->flushing = true;
+      avcodec_send_packet(av->dec, NULL);
+      continue;
+    }
+    av->last_packet = what_time_is_it_now();
+    if (av->pkt->stream_index == av->stream && want_packet(av, av->pkt)) {
+      avcodec_send_packet(av->dec, av->pkt);
+      if (av->key_only) {
+        // Nothing follows a sampled keyframe for a whole interval, so have the decoder output
+        // it now instead of holding it back until the next one
+        avcodec_send_packet(av->dec, NULL);
+        av->draining_key = true;
+      }
+    }
+    av_packet_unref(av->pkt);
+  }
+
+  return 0;
+}
+
+
+bool libav_stalled(libav_input_t *av)
+{
+  return av->stalled;
+}
+
+
+void libav_interrupt(libav_input_t *av)
+{
+  av->stop = true;
+}
+
+
+void libav_close(libav_input_t *av)
+{
+  if (av == NULL)
+    return;
+  close_stream(av);
+  sws_freeContext(av->sws);
+  av_frame_free(&av->frame);
+  av_packet_free(&av->pkt);
+  free(av->url);
+  free(av);
+}
+
+#else
+
+libav_input_t *libav_open(const char *url, dim_t fit, double interval, skip_mode_t skip, double stall_timeout)
+{
+  printf("ERROR: cannot open %s; TDS was built without libav support (-DLIBAV)\n", url);
+  return NULL;
+}
+
+
+size_t libav_read_frame(libav_input_t *av, frame_t *frame)
+{
+  return 0;
+}
+
+
+bool libav_stalled(libav_input_t *av)
+{
+  return false;
+}
+
+
+int libav_restart(libav_input_t *av)
+{
+  return -1;
+}
+
+
+void libav_interrupt(libav_input_t *av)
+{
+}
+
+
+void libav_close(libav_input_t *av)
+{
+}
+
+#endif
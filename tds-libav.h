@@ -0,0 +1,48 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_LIBAV_H
+#define TDS_LIBAV_H
+
+#include <stddef.h>
+#include "tds.h"
+
+// In-process decoding with libavformat/libavcodec (build with -DLIBAV). Frames are decoded,
+// sampled and converted to rgb24 straight into the caller's frame buffer, without an ffmpeg
+// child process or a pipe in between.
+typedef struct libav_input libav_input_t;
+
+// Frames are written as rgb24 images of the stream's own size, or scaled down to their letterbox
+// size within fit (prescale mode) if fit is not 0x0. One frame is returned every interval
+// seconds of stream time; skip selects the frames that are not even decoded. A read gives up
+// once the stream sends nothing for stall_timeout seconds (0: it waits forever). Returns NULL
+// only if out of memory: a stream that cannot be opened is left closed, and reads fail until
+// libav_restart() succeeds.
+libav_input_t *libav_open(const char *url, dim_t fit, double interval, skip_mode_t skip, double stall_timeout);
+// Decodes the next frame into the frame's buffer, growing it if needed, and sets the frame's
+// size. Returns the number of bytes written, 0 at the end of the stream or on error
+size_t libav_read_frame(libav_input_t *av, frame_t *frame);
+// Whether the last libav_read_frame() gave up because the stream stalled
+bool   libav_stalled(libav_input_t *av);
+// Closes and reopens the stream after an error, keeping the settings. Returns 0 on success;
+// on failure it can be called again later
+int libav_restart(libav_input_t *av);
+// Makes a blocked or future libav_read_frame() return 0 (safe to call from another thread)
+void libav_interrupt(libav_input_t *av);
+void libav_close(libav_input_t *av);
+
+#endif
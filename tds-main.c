@@ -17,336 +17,2010 @@
 
 #include <stdio.h>
 #include <stddef.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <assert.h>
 #include <time.h>
+#include <math.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
 #include "darknet.h"
 #include "utils/microjson-1.6/mjson.h"
+#include "tds.h"
+#include "tds-queue.h"
+#include "tds-convert.h"
+#include "tds-pool.h"
+#include "tds-libav.h"
+#include "tds-images.h"
+#include "tds-ppm.h"
+#include "tds-weights.h"
+#include "tds-supervisor.h"
+#include "tds-motion.h"
+#include "tds-track.h"
 
-#define FFPROBE_CMD "ffprobe -v error -show_entries stream=width,height -of default=noprint_wrappers=1:nokey=1 %s"
 //#define FFMPEG_CMD  "ffmpeg -hide_banner -loglevel error -rtsp_transport tcp -i %s -filter:v fps=0.25 -f image2pipe -vcodec rawvideo -pix_fmt rgb24 -"
 //#define FFMPEG_CMD  "ffmpeg -hide_banner -loglevel error -i %s -filter:v fps=0.25 -f image2pipe -vcodec rawvideo -pix_fmt rgb24 -"
-#define FFMPEG_CMD "ffmpeg -hide_banner -loglevel error -r 60 -i %s -r 0.25 -f image2pipe -vcodec rawvideo -pix_fmt rgb24 -"
-#define CAMS 6
+// Frames are piped as binary PPM images (see tds-ppm.h), so every frame carries its own size
+#define FFMPEG_CMD "ffmpeg -hide_banner -loglevel error -fflags nobuffer -flags low_delay %s-i %s %s-r %g -f image2pipe -vcodec ppm -"
+#define FFMPEG_IMAGE_CMD "ffmpeg -hide_banner -loglevel error -i %s %s-f image2pipe -vcodec ppm -"
+// Offline video files are decoded as fast as TDS consumes the frames (no rate options)
+#define FFMPEG_VIDEO_CMD "ffmpeg -hide_banner -loglevel error -i %s %s-f image2pipe -vcodec ppm -"
+#define FFPROBE_RATE_CMD "ffprobe -v error -select_streams v:0 -show_entries stream=avg_frame_rate -of default=noprint_wrappers=1:nokey=1 %s"
+// Scales frames to their letterbox size within the network input; the padding is added by
+// the preprocess stage, with letterbox_image()'s exact 0.5 fill
+#define FFMPEG_PRESCALE_FILTER "scale=%d:%d:force_original_aspect_ratio=decrease:flags=bilinear"
+// Frame stride of offline video files: every Nth frame, or one frame every T seconds of media time
+#define FFMPEG_STRIDE_FILTER   "select=not(mod(n\\,%d))"
+#define FFMPEG_INTERVAL_FILTER "fps=1/%g"
+#define SAMPLE_INTERVAL 4.0  // Default seconds between sampled frames of a camera
+#define STALL_TIMEOUT 30.0   // Default seconds without data after which a camera is unhealthy
+#define MOTION_REFRESH 60.0  // Default seconds after which a static scene is classified anyway
+#define MAX_CROPS 8          // Most crops of a frame classified separately (motion regions or tiles)
+#define TILE_OVERLAP 0.2     // Default share of a tile's width (height) that overlaps the next tile
+#define SEAM_MARGIN 4        // Pixels from a crop's edge within which a box is cut by the edge
+#define MERGE_OVERLAP 0.5    // Overlap, relative to the smaller box, of boxes of two crops to merge
+#define CANDIDATE_THRESH 0.1 // Default confidence of the first network's boxes that need confirming
+#define INGEST_POLL_MS 200   // Longest wait of the ingest thread, to check stalls and exit_loop
+#define INGEST_CHUNK 65536   // Bytes per read of a frame being discarded
+#define INGEST_EVENTS 16     // Ready cameras handled per epoll_wait() of the ingest thread
+#define RECONNECT_MIN 1.0    // Seconds before reconnecting a failed camera; doubles after every
+#define RECONNECT_MAX 60.0   // failed attempt, up to this
 #define CATEGS 80
+#define QUEUE_DEPTH 2
+#define POOL_FRAMES (QUEUE_DEPTH+2)  // Frames per camera: one being read, the rest in flight
+#define INITIAL_CAMS 8
+#define WATCHDOG_TIMEOUT 120.0  // Default seconds a worker may go without classifying a frame (-s)
 
 const char *build_str = "This build was compiled at " __DATE__ ", " __TIME__ ".";
 
 static int coco_ids[] = {1,2,3,4,5,6,7,8,9,10,11,13,14,15,16,17,18,19,20,21,22,23,24,25,27,28,31,32,33,34,35,36,37,38,39,40,41,42,43,44,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63,64,65,67,70,72,73,74,75,76,77,78,79,80,81,82,84,85,86,87,88,89,90};
 
-bool exit_loop      = false;
-unsigned int tds_id = 0;
+volatile bool exit_loop = false;
+unsigned int tds_id    = 0;
+
+typedef struct {
+  char url[512];
+  char backend[16];       // "ffmpeg" (default) or "libav"
+  char skip_frames[16];   // "none" (default), "nonref", "nokey" or "auto"
+  skip_mode_t skip;
+  double interval;        // Seconds between sampled frames (SAMPLE_INTERVAL by default)
+  int priority;           // Higher goes first among late frames (0 by default)
+  double stall_timeout;   // Seconds without data before the camera is unhealthy (STALL_TIMEOUT)
+  double motion_threshold;  // Fraction of the frame that must change for it to be classified (0: all are)
+  double motion_refresh;  // Seconds after which a static scene is classified anyway (MOTION_REFRESH)
+  int motion_crops;       // Classify up to this many changed regions at full resolution (0: off)
+  char tiles[16];         // "<cols>x<rows>" tiles each frame is classified as ("": whole frames)
+  int tile_cols;
+  int tile_rows;
+  double tile_overlap;    // Share of a tile that overlaps its neighbors (TILE_OVERLAP)
+  int track_interval;     // Track objects, detecting them on every Nth frame (0: no tracking)
+} cam_conf_t;
 
 typedef struct {
   char darknet_home[512];
   char darknet_datacfg[512];
   char darknet_cfgfile[512];
   char darknet_weightfile[512];
+  char confirm_cfgfile[512];    // Second network of a cascade, which confirms the candidates of the
+  char confirm_weightfile[512]; // first one ("": no cascade)
+  double candidate_thresh;      // Confidence of a first-network box that makes it a candidate
   char input_image[512];
-  char input_stream_1[512];
-  char input_stream_2[512];
-  char input_stream_3[512];
-  char input_stream_4[512];
-  char input_stream_5[512];
-  char input_stream_6[512];
+  char input_images[512]; // Directory, glob pattern or list file of images to classify
+  char input_video[512];  // Video file processed offline, as fast as possible
+  int frame_stride;       // Offline video: classify every Nth frame...
+  double frame_interval;  // ...or one frame every T seconds of media time (if > 0)
+  int decode_threads;     // Image decoding threads in image-directory mode (0: one per CPU)
+  cam_conf_t *cameras;    // One entry per object in the "cameras" JSON array
+  int ncams;
+  int batch_size;         // Max. number of frames (from any camera) per forward pass
+  int batch_wait_ms;      // Max. time to wait for a batch to fill up
+  bool prescale;          // Have ffmpeg letterbox frames to the network input size
+  bool weight_cache;      // Map the weights from a cache written next to them on the first start
+  bool shared_weights;    // Share one read-only copy of the weights among the TDS processes
   bool use_input_image;
+  bool use_input_images;
+  bool use_input_video;
   bool use_input_stream;
 } conf_params_t;
 
-typedef struct {
-  int width;
-  int height;
-  int c;
-} dim_t;
+typedef struct {
+  unsigned long frames;
+  unsigned long read_errors;
+  double read_time;
+  double decode_cpu;      // CPU seconds spent decoding (ffmpeg process or libav calls)
+  unsigned long missed_deadlines;  // Frames classified after the camera's next sample was due
+  unsigned long dropped;  // Frames superseded by a newer one before inference took them
+  unsigned long stalls;   // Times the camera sent no data for stall_timeout seconds
+  unsigned long reconnects;
+  unsigned long skipped;  // Static frames not inferred, which got the last detections instead
+  unsigned long cropped;  // Frames of which only the changed regions were inferred
+  unsigned long candidates;  // Cascade: frames with candidates, which went through the second network
+  unsigned long tracked;  // Frames not inferred, which got the camera's tracks moved to them
+  unsigned long inferred; // Frames that reached inference, and their age at that point
+  double age_sum;
+  double age_max;
+} cam_stats_t;
+
+struct pipeline;
+
+// Per-camera state: input pipe, reader thread, frame pool and statistics
+typedef struct {
+  struct pipeline *pipeline;
+  int cam_id;
+  const char *url;
+  FILE *pipein;           // ffmpeg child process (ffmpeg backend)
+  pid_t pid;
+  char cmd[1024];         // ffmpeg command of a live camera, to restart it
+  libav_input_t *av;      // In-process decoder (libav backend)
+  double interval;        // Seconds between sampled frames (0 for files, which have no deadlines)
+  int priority;
+  double stall_timeout;
+  pthread_t thread;       // Reader thread (libav cameras and files)
+  ppm_header_t ppm;       // Header of the next frame in the pipe, as it is parsed
+  dim_t dim;              // Size of the camera's latest frame
+  size_t frame_bytes;     // Pixel data of the frame being read
+  bool in_frame;          // Epoll ingest (ffmpeg cameras): header read, pixel data being received
+  frame_t *fill;          // into this frame,
+  size_t filled;          // bytes of it received so far,
+  bool discarding;        // whether they are dropped for lack of a free frame,
+  double fill_start;      // when its first bytes were read,
+  double last_data;       // and when the last bytes did
+  bool healthy;           // Data arrived within the last stall_timeout seconds
+  double backoff;         // Seconds before the next reconnection attempt,
+  double retry_at;        // which is due at this time
+  double motion_threshold;  // Fraction of the frame that must change for inference (0: no gating)
+  double motion_refresh;  // Seconds after which a static scene is classified anyway
+  int motion_crops;       // Most changed regions classified instead of the whole frame
+  int tile_cols;          // Tiles classified instead of the whole frame (0: none)
+  int tile_rows;
+  double tile_overlap;
+  int max_crops;          // Crops of a frame there must be room for (motion regions or tiles)
+  motion_t motion;        // Change since the last classified frame,
+  double last_inference;  // when that frame was captured,
+  detection *last_dets;   // and its detections, carried forward to the static frames
+  int last_nboxes;
+  int track_interval;     // Frames per detection of a tracked camera (0: not tracked)
+  tracker_t tracker;      // Its tracks (inference stage),
+  int tracked;            // frames tracked since the last detection (preprocess stage),
+  volatile bool track_lost;  // and whether a track left the frame since then
+  bool running;
+  frame_pool_t pool;
+  cam_stats_t stats;
+} camera_t;
+
+// The application supports an arbitrary number of input streams
+typedef struct {
+  camera_t *cams;
+  int ncams;
+} input_t;
+
+// State shared by the pipeline stages. Each stage runs in its own thread and hands frames
+// to the next one through a bounded queue, so a stage blocks only when the next one falls behind
+typedef struct pipeline {
+  conf_params_t *conf;
+  input_t *input;
+  double frame_step;      // Offline video: media time between classified frames (seconds)
+  network *net;
+  network *confirm_net;   // Second network of the cascade (NULL: none), which runs on the inputs
+  float candidate_thresh; // where net finds boxes above candidate_thresh;
+  int *confirm_slot;      // each input's place in its batch (-1: no candidates)
+  metadata meta;
+  char **names;
+  image **alphabet;
+  float thresh;
+  float hier_thresh;
+  float nms;
+  FILE *fp_pred;
+  FILE *fp_log;
+  FILE *fp_events;        // Objects entering and leaving the tracked cameras (NULL: none)
+  queue_t ingest_q;       // reader    -> preprocess (latest frame of each camera, earliest deadline first)
+  queue_t infer_q;        // preprocess -> inference
+  queue_t output_q;       // inference  -> output
+  int active_readers;
+  pthread_t ingest_thread;
+  pthread_mutex_t lock;
+  pthread_cond_t reader_done;
+  pthread_t preprocess_thread;
+  pthread_t infer_thread;
+  pthread_t output_thread;
+  image_list_t images;    // Image-directory mode: files to classify,
+  int next_image;         // next one to be decoded
+  int ndecoders;
+  pthread_t *decoders;
+  unsigned long count;    // Frames that reached the output stage
+  image snapshot;         // Image used by the output stage to save detections,
+  size_t snapshot_size;   // and its allocated bytes
+  short (*sequence)[CATEGS];
+  bool *seen;             // Cameras already reported in the current sequence
+  char *sequence_str;
+  double launch_time;     // When TDS started, to report how long the first frame took
+  int max_inputs;         // Network inputs per batch: batch_size frames, or their crops
+  int max_boxes;          // Boxes a network input may have (in either network of a cascade)
+} pipeline_t;
+
+// Model files, loaded in the background while the inputs are opened
+typedef struct {
+  char *datacfg;          // NULL for the confirming network of a cascade, which shares the labels
+  char *cfgfile;
+  char *weightfile;
+  int cache_flags;        // WEIGHT_CACHE_* (0: no cache)
+  weight_cache_t cache;
+  network *net;           // Parsed from the model config before the load starts
+  metadata meta;
+  char **names;
+  image **alphabet;
+  double load_time;
+} model_t;
+
+
+int parse_config_file(char *filename, conf_params_t *conf_params)
+{
+  printf("Config file:   %s\n", filename);
+
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) {
+      printf("ERROR: cannot open %s\n", filename);
+      return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long fsize = ftell(f);
+  fseek(f, 0, SEEK_SET);  /* same as rewind(f); */
+  char *string = malloc(fsize + 1);
+  fread(string, 1, fsize, f);
+  fclose(f);
+  string[fsize] = 0;
+
+  /* Mapping of JSON attributes of each camera object to cam_conf_t's struct members */
+  const struct json_attr_t json_cam_attrs[] = {
+       {"url", t_string, STRUCTOBJECT(cam_conf_t, url), .len = sizeof(conf_params->cameras[0].url)},
+       {"backend", t_string, STRUCTOBJECT(cam_conf_t, backend), .len = sizeof(conf_params->cameras[0].backend)},
+       {"skip_frames", t_string, STRUCTOBJECT(cam_conf_t, skip_frames), .len = sizeof(conf_params->cameras[0].skip_frames)},
+       {"interval", t_real, STRUCTOBJECT(cam_conf_t, interval), .dflt.real = SAMPLE_INTERVAL},
+       {"priority", t_integer, STRUCTOBJECT(cam_conf_t, priority), .dflt.integer = 0},
+       {"stall_timeout", t_real, STRUCTOBJECT(cam_conf_t, stall_timeout), .dflt.real = STALL_TIMEOUT},
+       {"motion_threshold", t_real, STRUCTOBJECT(cam_conf_t, motion_threshold), .dflt.real = 0},
+       {"motion_refresh", t_real, STRUCTOBJECT(cam_conf_t, motion_refresh), .dflt.real = MOTION_REFRESH},
+       {"motion_crops", t_integer, STRUCTOBJECT(cam_conf_t, motion_crops), .dflt.integer = 0},
+       {"tiles", t_string, STRUCTOBJECT(cam_conf_t, tiles), .len = sizeof(conf_params->cameras[0].tiles)},
+       {"tile_overlap", t_real, STRUCTOBJECT(cam_conf_t, tile_overlap), .dflt.real = TILE_OVERLAP},
+       {"track_interval", t_integer, STRUCTOBJECT(cam_conf_t, track_interval), .dflt.integer = 0},
+       {NULL},
+     };
+
+  int maxcams = 0;
+  int status;
+  conf_params->cameras = NULL;
+  conf_params->ncams   = 0;
+  do {
+    // microjson parses into fixed-extent memory, so we grow the camera array until all cameras fit
+    maxcams = (maxcams == 0) ? INITIAL_CAMS : 2*maxcams;
+    conf_params->cameras = realloc(conf_params->cameras, sizeof(cam_conf_t)*maxcams);
+
+    /* Mapping of JSON attributes to C my_object's struct members */
+    const struct json_attr_t json_attrs[] = {
+         {"darknet_home", t_string, .addr.string = conf_params->darknet_home, .len = sizeof(conf_params->darknet_home)},
+         {"darknet_datacfg", t_string, .addr.string = conf_params->darknet_datacfg, .len = sizeof(conf_params->darknet_datacfg)},
+         {"darknet_cfgfile", t_string, .addr.string = conf_params->darknet_cfgfile, .len = sizeof(conf_params->darknet_cfgfile)},
+         {"darknet_weightfile", t_string, .addr.string = conf_params->darknet_weightfile, .len = sizeof(conf_params->darknet_weightfile)},
+         {"confirm_cfgfile", t_string, .addr.string = conf_params->confirm_cfgfile, .len = sizeof(conf_params->confirm_cfgfile)},
+         {"confirm_weightfile", t_string, .addr.string = conf_params->confirm_weightfile, .len = sizeof(conf_params->confirm_weightfile)},
+         {"candidate_thresh", t_real, .addr.real = &conf_params->candidate_thresh, .dflt.real = CANDIDATE_THRESH},
+         {"input_image", t_string, .addr.string = conf_params->input_image, .len = sizeof(conf_params->input_image)},
+         {"input_images", t_string, .addr.string = conf_params->input_images, .len = sizeof(conf_params->input_images)},
+         {"decode_threads", t_integer, .addr.integer = &conf_params->decode_threads, .dflt.integer = 0},
+         {"input_video", t_string, .addr.string = conf_params->input_video, .len = sizeof(conf_params->input_video)},
+         {"frame_stride", t_integer, .addr.integer = &conf_params->frame_stride, .dflt.integer = 1},
+         {"frame_interval", t_real, .addr.real = &conf_params->frame_interval, .dflt.real = 0},
+         {"batch_size", t_integer, .addr.integer = &conf_params->batch_size, .dflt.integer = 1},
+         {"batch_wait_ms", t_integer, .addr.integer = &conf_params->batch_wait_ms, .dflt.integer = 200},
+         {"prescale", t_boolean, .addr.boolean = &conf_params->prescale, .dflt.boolean = false},
+         {"weight_cache", t_boolean, .addr.boolean = &conf_params->weight_cache, .dflt.boolean = false},
+         {"shared_weights", t_boolean, .addr.boolean = &conf_params->shared_weights, .dflt.boolean = false},
+         {"cameras", t_array, .addr.array.element_type = t_structobject,
+                              .addr.array.arr.objects.subtype = json_cam_attrs,
+                              .addr.array.arr.objects.base = (char *)conf_params->cameras,
+                              .addr.array.arr.objects.stride = sizeof(cam_conf_t),
+                              .addr.array.count = &conf_params->ncams,
+                              .addr.array.maxlen = maxcams},
+         {NULL},
+       };
+
+    /* Parse the JSON string from buffer */
+    status = json_read_object(string, json_attrs, NULL);
+  } while (status == JSON_ERR_SUBTOOLONG);
+  free(string);
+
+  if (status != 0) {
+    puts(json_error_string(status));
+    return -1;
+  }
+
+  conf_params->use_input_image  = false;
+  conf_params->use_input_images = false;
+  conf_params->use_input_video  = false;
+  conf_params->use_input_stream = false;
+
+  if (conf_params->input_image[0] != '\0')
+    // Use image file
+    conf_params->use_input_image = true;
+  else if (conf_params->input_images[0] != '\0')
+    // Use a directory (or glob pattern, or list) of image files
+    conf_params->use_input_images = true;
+  else if (conf_params->input_video[0] != '\0')
+    // Process a video file offline
+    conf_params->use_input_video = true;
+  else
+    if (conf_params->ncams > 0) {
+      // Use RTSP video stream(s)
+      conf_params->use_input_stream = true;
+      conf_params->use_input_image  = false;
+    }
+
+  if (!conf_params->use_input_image && !conf_params->use_input_images && !conf_params->use_input_video &&
+      !conf_params->use_input_stream) {
+    printf("ERROR: input_image, input_images, input_video and cameras cannot all be empty in the configuration file\n");
+    return -1;
+  }
+
+  if (conf_params->frame_stride < 1 || conf_params->frame_interval < 0) {
+    printf("ERROR: frame_stride must be at least 1 and frame_interval cannot be negative\n");
+    return -1;
+  }
+
+  if (conf_params->decode_threads <= 0)
+    conf_params->decode_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (conf_params->batch_size < 1 || conf_params->batch_wait_ms < 0) {
+    printf("ERROR: batch_size must be at least 1 and batch_wait_ms cannot be negative\n");
+    return -1;
+  }
+
+  if (conf_params->candidate_thresh <= 0 || conf_params->candidate_thresh > 1) {
+    printf("ERROR: candidate_thresh must be between 0 and 1\n");
+    return -1;
+  }
+
+  int i;
+  for (i = 0; i < conf_params->ncams; i++)
+    if (conf_params->cameras[i].url[0] == '\0') {
+      printf("ERROR: camera %d has no url in the configuration file\n", i+1);
+      return -1;
+    }
+    else if (conf_params->cameras[i].backend[0] == '\0')
+      strcpy(conf_params->cameras[i].backend, "ffmpeg");
+    else if (strcmp(conf_params->cameras[i].backend, "ffmpeg") != 0 && strcmp(conf_params->cameras[i].backend, "libav") != 0) {
+      printf("ERROR: camera %d has an unknown backend (%s)\n", i+1, conf_params->cameras[i].backend);
+      return -1;
+    }
+
+  for (i = 0; i < conf_params->ncams; i++) {
+    cam_conf_t *cam = &conf_params->cameras[i];
+    if (cam->skip_frames[0] == '\0' || strcmp(cam->skip_frames, "none") == 0)
+      cam->skip = SKIP_NONE;
+    else if (strcmp(cam->skip_frames, "nonref") == 0)
+      cam->skip = SKIP_NONREF;
+    else if (strcmp(cam->skip_frames, "nokey") == 0)
+      cam->skip = SKIP_NOKEY;
+    else if (strcmp(cam->skip_frames, "auto") == 0)
+      cam->skip = SKIP_AUTO;
+    else {
+      printf("ERROR: camera %d has an unknown skip_frames mode (%s)\n", i+1, cam->skip_frames);
+      return -1;
+    }
+    if (cam->interval <= 0) {
+      printf("ERROR: camera %d must have a positive sample interval\n", i+1);
+      return -1;
+    }
+    if (cam->stall_timeout <= cam->interval) {
+      printf("ERROR: camera %d must have a stall_timeout longer than its sample interval\n", i+1);
+      return -1;
+    }
+    if (cam->motion_threshold < 0 || cam->motion_threshold > 1 || cam->motion_refresh <= 0) {
+      printf("ERROR: camera %d must have a motion_threshold between 0 and 1 and a positive motion_refresh\n", i+1);
+      return -1;
+    }
+    if (cam->motion_crops < 0 || cam->motion_crops > MAX_CROPS) {
+      printf("ERROR: camera %d must have between 0 and %d motion_crops\n", i+1, MAX_CROPS);
+      return -1;
+    }
+    if (cam->motion_crops > 0 && (cam->motion_threshold == 0 || conf_params->prescale)) {
+      printf("ERROR: camera %d needs a motion_threshold, and prescale to be off, for motion_crops\n", i+1);
+      return -1;
+    }
+    cam->tile_cols = cam->tile_rows = 0;
+    if (cam->tiles[0] != '\0') {
+      if (sscanf(cam->tiles, "%dx%d", &cam->tile_cols, &cam->tile_rows) != 2 || cam->tile_cols < 1 ||
+          cam->tile_rows < 1 || cam->tile_cols*cam->tile_rows < 2 || cam->tile_cols*cam->tile_rows > MAX_CROPS) {
+        printf("ERROR: camera %d has invalid tiles (%s); they must be <cols>x<rows>, 2 to %d of them\n", i+1,
+               cam->tiles, MAX_CROPS);
+        return -1;
+      }
+      if (cam->tile_overlap < 0 || cam->tile_overlap > 0.5) {
+        printf("ERROR: camera %d must have a tile_overlap between 0 and 0.5\n", i+1);
+        return -1;
+      }
+      if (cam->motion_crops > 0 || conf_params->prescale) {
+        printf("ERROR: camera %d cannot have tiles with motion_crops or prescale\n", i+1);
+        return -1;
+      }
+    }
+    if (cam->track_interval < 0) {
+      printf("ERROR: camera %d cannot have a negative track_interval\n", i+1);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+// Average frame rate of a video file, needed to give media times to every-Nth-frame sampling
+double get_video_frame_rate(const char *filename)
+{
+  char ffprobe_cmd[1024];
+  char line[64];
+  int num = 0, den = 0;
+
+  snprintf(ffprobe_cmd, 1024, FFPROBE_RATE_CMD, filename);
+  FILE *pipein = popen(ffprobe_cmd, "r");
+  if (pipein == NULL)
+    return 0;
+  if (fgets(line, sizeof(line), pipein) != NULL)
+    sscanf(line, "%d/%d", &num, &den);
+  pclose(pipein);
+
+  return (den > 0) ? (double)num/den : 0;
+}
+
+
+// Like popen(cmd, "r"), but the child's pid is kept so that its CPU time can be collected
+// when it is reaped. The shell execs the command, so the pid is ffmpeg's own
+FILE *spawn_pipe(const char *cmd, pid_t *pid)
+{
+  char shell_cmd[1100];
+  int fd[2];
+
+  snprintf(shell_cmd, sizeof(shell_cmd), "exec %s", cmd);
+  if (pipe(fd) != 0)
+    return NULL;
+  // Keep other cameras' ffmpeg processes from inheriting this pipe
+  fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+
+  *pid = fork();
+  if (*pid < 0) {
+    close(fd[0]);
+    close(fd[1]);
+    return NULL;
+  }
+  if (*pid == 0) {
+    dup2(fd[1], STDOUT_FILENO);
+    execl("/bin/sh", "sh", "-c", shell_cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(fd[1]);
+  return fdopen(fd[0], "r");
+}
+
+
+// Like pclose(); returns the CPU time (user + system) used by the child
+double close_pipe(FILE *pipe, pid_t pid)
+{
+  struct rusage usage;
+  fclose(pipe);
+  while (wait4(pid, NULL, 0, &usage) < 0)
+    if (errno != EINTR)
+      return 0;
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+}
+
+
+// Input options of the ffmpeg command for each skip_frames mode. Skipping frames changes the
+// input frame rate, so the stream's timestamps are used rather than forcing the input to 60 fps.
+// Following the GOP (auto) needs the libav backend; ffmpeg falls back to skipping non-reference frames
+static const char *ffmpeg_input_opts[] = {
+  [SKIP_NONE]   = "-r 60 ",
+  [SKIP_NONREF] = "-skip_frame nonref ",
+  [SKIP_NOKEY]  = "-skip_frame nokey ",
+  [SKIP_AUTO]   = "-skip_frame nonref ",
+};
+
+
+typedef struct {
+  camera_t *cam;          // NULL for the cameras that are not libav ones
+  dim_t fit;
+  skip_mode_t skip;
+  bool threaded;
+} libav_opener_t;
+
+
+// Opening a libav camera blocks on the network (connection and stream probing)
+void *open_libav_thread(void *arg)
+{
+  libav_opener_t *opener = arg;
+  camera_t *cam = opener->cam;
+  cam->av = libav_open(cam->url, opener->fit, cam->interval, opener->skip, cam->stall_timeout);
+  return NULL;
+}
+
+
+// In prescale mode, frames are scaled to fit within the network input: vfilter is the ffmpeg
+// filter chain (empty for none), and libav cameras are given the network size as fit (0x0 for
+// full-resolution frames)
+int open_input_pipes(conf_params_t conf_params, input_t *input, dim_t fit, const char *vfilter)
+{
+  char filter[300] = "";
+  if (vfilter[0] != '\0')
+    snprintf(filter, sizeof(filter), "-vf '%s' ", vfilter);
+
+  // A single image file, a set of them or a video file is handled as a one-camera input
+  input->ncams = (conf_params.use_input_image || conf_params.use_input_images || conf_params.use_input_video) ? 1 : conf_params.ncams;
+  input->cams  = calloc(input->ncams, sizeof(camera_t));
+  libav_opener_t *openers = calloc(input->ncams, sizeof(libav_opener_t));
+  if (input->cams == NULL || openers == NULL) {
+    printf("ERROR: cannot allocate %d cameras\n", input->ncams);
+    return -1;
+  }
+
+  char ffmpeg_cmd[1024];
+  int i;
+  for (i = 0; i < input->ncams; i++) {
+    camera_t *cam = &input->cams[i];
+    cam->cam_id = i+1;
+    if (conf_params.use_input_stream) {
+      // Settings shared by the cameras of both backends
+      cam->url              = conf_params.cameras[i].url;
+      cam->interval         = conf_params.cameras[i].interval;
+      cam->priority         = conf_params.cameras[i].priority;
+      cam->stall_timeout    = conf_params.cameras[i].stall_timeout;
+      cam->motion_threshold = conf_params.cameras[i].motion_threshold;
+      cam->motion_refresh   = conf_params.cameras[i].motion_refresh;
+      cam->motion_crops     = conf_params.cameras[i].motion_crops;
+      cam->tile_cols        = conf_params.cameras[i].tile_cols;
+      cam->tile_rows        = conf_params.cameras[i].tile_rows;
+      cam->tile_overlap     = conf_params.cameras[i].tile_overlap;
+      cam->max_crops        = cam->motion_crops + cam->tile_cols*cam->tile_rows;
+      cam->track_interval   = conf_params.cameras[i].track_interval;
+    }
+    if (conf_params.use_input_images) {
+      // Images are decoded in-process by the decoding threads
+      cam->url = conf_params.input_images;
+      continue;
+    }
+    else if (conf_params.use_input_image) {
+      // Use image file
+      cam->url = conf_params.input_image;
+      snprintf(ffmpeg_cmd, 1024, FFMPEG_IMAGE_CMD, cam->url, filter);
+    }
+    else if (conf_params.use_input_video) {
+      // Use video file
+      cam->url = conf_params.input_video;
+      snprintf(ffmpeg_cmd, 1024, FFMPEG_VIDEO_CMD, cam->url, filter);
+    }
+    else if (strcmp(conf_params.cameras[i].backend, "libav") == 0) {
+      // Decode the RTSP video stream in-process. libav cameras are all opened at once, each in
+      // its own thread; the reader thread handle is not in use yet
+      openers[i] = (libav_opener_t){cam, fit, conf_params.cameras[i].skip, true};
+      if (pthread_create(&cam->thread, NULL, open_libav_thread, &openers[i]) != 0) {
+        openers[i].threaded = false;
+        open_libav_thread(&openers[i]);
+      }
+      continue;
+    }
+    else {
+      // Use RTSP video stream
+      snprintf(ffmpeg_cmd, 1024, FFMPEG_CMD, ffmpeg_input_opts[conf_params.cameras[i].skip], cam->url, filter,
+               1/cam->interval);
+    }
+    if (conf_params.use_input_stream)
+      strcpy(cam->cmd, ffmpeg_cmd);
+    cam->pipein = spawn_pipe(ffmpeg_cmd, &cam->pid);
+    // Pixel data is read whole straight into the frame buffers; a stdio buffer would only add
+    // a copy (and be allocated on the first read)
+    if (cam->pipein != NULL)
+      setvbuf(cam->pipein, NULL, _IONBF, 0);
+    printf("pipein_%d = %p (%s)\n", cam->cam_id, (void *)cam->pipein, cam->url);
+  }
+
+  for (i = 0; i < input->ncams; i++) {
+    camera_t *cam = openers[i].cam;
+    if (cam == NULL)
+      continue;
+    if (openers[i].threaded)
+      pthread_join(cam->thread, NULL);
+    printf("libav_%d = %p (%s, every %g sec, priority %d)\n", cam->cam_id, (void *)cam->av, cam->url,
+           cam->interval, cam->priority);
+  }
+  free(openers);
+
+  return 0;
+}
+
+
+bool camera_is_open(camera_t *cam)
+{
+  return cam->pipein != NULL || cam->av != NULL;
+}
+
+
+void close_input_pipes(input_t input)
+{
+  // Flush and close input and output pipes; the ffmpeg processes' CPU time is collected as they exit
+  int i;
+  for (i = 0; i < input.ncams; i++)
+    if (input.cams[i].pipein != NULL) {
+      // A live camera's ffmpeg may be blocked waiting for the network rather than writing to us
+      if (input.cams[i].cmd[0] != '\0')
+        kill(input.cams[i].pid, SIGTERM);
+      fflush(input.cams[i].pipein);
+      input.cams[i].stats.decode_cpu += close_pipe(input.cams[i].pipein, input.cams[i].pid);
+      input.cams[i].pipein = NULL;
+    }
+    else {
+      libav_close(input.cams[i].av);
+      input.cams[i].av = NULL;
+    }
+}
+
+
+// elapsed is the wall time the cameras were read for; decode CPU is also given as a share of it
+void print_camera_stats(input_t input, double elapsed, bool cascade)
+{
+  int i;
+  printf("\nCamera statistics:\n");
+  for (i = 0; i < input.ncams; i++) {
+    cam_stats_t *stats = &input.cams[i].stats;
+    printf("  cam %3d: %8lu frames, %6lu read errors, avg read time %.4f sec, decode CPU %.2f sec (%.1f%%), "
+           "%lu missed deadlines\n",
+           input.cams[i].cam_id, stats->frames, stats->read_errors,
+           stats->frames ? stats->read_time/stats->frames : 0.,
+           stats->decode_cpu, elapsed > 0 ? 100*stats->decode_cpu/elapsed : 0., stats->missed_deadlines);
+    printf("           %8lu stale frames dropped, frame age at inference avg %.3f sec, max %.3f sec, %lu stalls, %lu reconnects\n",
+           stats->dropped, stats->inferred ? stats->age_sum/stats->inferred : 0., stats->age_max, stats->stalls,
+           stats->reconnects);
+    if (input.cams[i].motion_threshold > 0 || input.cams[i].max_crops > 0)
+      printf("           %8lu static frames not inferred (%.1f%% of the frames classified), %lu inferred as crops\n",
+             stats->skipped, stats->skipped + stats->inferred ? 100.*stats->skipped/(stats->skipped + stats->inferred) : 0.,
+             stats->cropped);
+    if (input.cams[i].track_interval > 0)
+      printf("           %8lu frames tracked between detections, %d objects tracked\n",
+             stats->tracked, input.cams[i].tracker.next_id - 1);
+    if (cascade)
+      printf("           %8lu frames with candidates confirmed by the second network (%.1f%% of the frames inferred)\n",
+             stats->candidates, stats->inferred ? 100.*stats->candidates/stats->inferred : 0.);
+  }
+}
+
+
+// Loads what takes long in the model (the weights, and the labels and their images), while the
+// main thread connects to the cameras
+void *load_model_thread(void *arg)
+{
+  model_t *model = arg;
+  double start = what_time_is_it_now();
+
+  if (model->datacfg != NULL) {
+    list *options = read_data_cfg(model->datacfg);
+    model->meta   = get_metadata(model->datacfg);
+    char *name_list = option_find_str(options, "names", "names.list");
+    model->names    = get_labels(name_list);
+    model->alphabet = load_alphabet();
+  }
+  if (model->weightfile[0] != '\0' &&
+      (model->cache_flags == 0 ||
+       weight_cache_load(model->net, model->cfgfile, model->weightfile, model->cache_flags, &model->cache) != 0)) {
+    load_weights(model->net, model->weightfile);
+    if (model->cache_flags != 0)
+      weight_cache_save(model->net, model->cfgfile, model->weightfile, model->cache_flags, &model->cache);
+  }
+
+  model->load_time = what_time_is_it_now() - start;
+  return NULL;
+}
+
+
+// Resident memory of this process, split as the kernel accounts it: private memory (heap,
+// activations, unshared weights), mapped files and shared memory. With shared weights, the
+// parameters are in the last two, which the processes of a node share
+void print_memory_usage(void)
+{
+  char line[128];
+  long anon = 0, file = 0, shmem = 0;
+
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f == NULL)
+    return;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    sscanf(line, "RssAnon: %ld", &anon);
+    sscanf(line, "RssFile: %ld", &file);
+    sscanf(line, "RssShmem: %ld", &shmem);
+  }
+  fclose(f);
+  printf("Resident memory: %.1f MB private, %.1f MB mapped files, %.1f MB shared memory\n",
+         anon/1024., file/1024., shmem/1024.);
+}
+
+
+void sig_handler(int signo)
+{
+  if (signo == SIGINT) {
+    exit_loop = true;
+    fflush(stdout);
+    fflush(stderr);
+  }
+}
+
+
+void print_usage(char * pname)
+{
+  printf("Usage: %s <OPTIONS>\n", pname);
+  printf(" OPTIONS:\n");
+  printf("    -h          : print this helpful usage info\n");
+  printf("    -c <file>   : JSON configuration file to use\n");
+  printf("    -d <dir>    : directory for this run (i.e. where all logs and output will be placed)\n");
+  printf("                :      Optional (default: current directory)\n");
+  printf("    -l <file>   : global log file where we append the classification results during the run\n");
+  printf("                :      Optional (default: no global logging)\n");
+  printf("    -i <id>     : integer id to assign to this run\n");
+  printf("                :      Optional (default: 0)\n");
+  printf("    -s          : supervisor mode: load the model once and run the pipeline in forked workers,\n");
+  printf("                :      replacing those that fail or hang (each one in a run directory under -d)\n");
+  printf("    -w <sec>    : supervisor mode: seconds a worker may go without classifying a frame\n");
+  printf("                :      Optional (default: %.0f)\n", WATCHDOG_TIMEOUT);
+}
+
+
+void to_json_string(short (*sequence)[CATEGS], int ncams, char *sequence_str)
+{
+  time_t timestamp;
+  int cam, categ;
+  // With many cameras the string gets long, so we append at a running offset instead of strcat()
+  int len;
+
+  time(&timestamp);
+
+  len = sprintf(sequence_str, "{\"id\":%d,\"ts\":%ld,", tds_id, timestamp);
+  for (cam=0; cam<ncams; cam++) {
+    len += sprintf(sequence_str+len, "\"%d\":[", cam+1);
+    for (categ=0; categ<CATEGS; categ++)
+      if (sequence[cam][categ] != -1)
+        len += sprintf(sequence_str+len, "%d,", coco_ids[categ]);
+    if (sequence_str[len-1] == ',')
+      len--;  // Remove last comma
+    len += sprintf(sequence_str+len, "],");
+  }
+  len--;  // Remove last comma
+  sprintf(sequence_str+len, "}");
+}
+
+
+// Reads the header of the next frame of a file's pipe. Bytes that are not a header are skipped
+int read_frame_header(camera_t *cam, dim_t *dim)
+{
+  unsigned char c;
+
+  ppm_header_reset(&cam->ppm);
+  while (fread(&c, 1, 1, cam->pipein) == 1)
+    if (ppm_header_feed(&cam->ppm, c, dim))
+      return 0;
+  return -1;
+}
+
+
+// Readers may be cancelled while blocked in fread() (e.g. when another camera made us quit),
+// so cancellation is only enabled around the reads themselves
+size_t read_pipe_frame(camera_t *cam, frame_t *frame, size_t *expected)
+{
+  size_t size = 0;
+  dim_t dim;
+  int status;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  status = read_frame_header(cam, &dim);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  if (status != 0 || frame_reserve(frame, dim.width*dim.height*dim.c) != 0)
+    return 0;
+
+  *expected     = dim.width*dim.height*dim.c;
+  frame->width  = dim.width;
+  frame->height = dim.height;
+  pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+  size = fread(frame->data, 1, *expected, cam->pipein);
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+  return size;
+}
+
+
+// Reads a frame into the frame buffer, growing it if needed. Returns the number of bytes of
+// pixel data read, and the number expected in *expected (0 if no frame header was found)
+size_t read_frame(camera_t *cam, frame_t *frame, size_t *expected)
+{
+  size_t size;
+
+  *expected = 0;
+  if (cam->av != NULL) {
+    // libav is not cancellation safe; readers are stopped with libav_interrupt() instead.
+    // Demuxing and decoding allocate inside libav, so they are left out of the accounting
+    struct timespec start, end;
+    alloc_debug_arm(false);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+    size = libav_read_frame(cam->av, frame);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+    alloc_debug_arm(true);
+    cam->stats.decode_cpu += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+    *expected = size;
+    return size;
+  }
+
+  pthread_cleanup_push(pool_put, frame);
+  size = read_pipe_frame(cam, frame, expected);
+  pthread_cleanup_pop(0);
+
+  if (cam->ppm.skipped > 0) {
+    printf("Warning: skipped %lu bytes of camera %d to find the next frame\n", cam->ppm.skipped, cam->cam_id);
+    cam->ppm.skipped = 0;
+  }
+  return size;
+}
+
+
+// Earliest-deadline-first order of the ingest queue. Once frames are late, inference cannot keep
+// up with all the cameras and EDF would make every one of them miss its deadlines, so the higher
+// priority cameras go first
+bool frame_before(const void *a, const void *b, double now)
+{
+  const frame_t *fa = a;
+  const frame_t *fb = b;
+
+  if (fa->priority != fb->priority) {
+    if (fa->deadline < now || fb->deadline < now)
+      return fa->priority > fb->priority;
+  }
+  return fa->deadline < fb->deadline;
+}
+
+
+// Identifies the frames of a camera by their pool
+bool frame_of_pool(const void *item, const void *key)
+{
+  return ((const frame_t *)item)->pool == key;
+}
+
+
+// Live cameras keep draining their input, so that a frame never waits in ffmpeg's buffers or in
+// the pipe. The ingest queue is their mailbox: it holds the latest frame of each camera, and a
+// frame that is superseded before inference takes it is dropped. Files are read frame by frame.
+// Returns the frame to read the next image of a camera into, NULL if there is none and we
+// cannot wait
+frame_t *camera_frame(pipeline_t *p, camera_t *cam, bool wait)
+{
+  frame_t *frame = NULL;
+  if (p->conf->use_input_stream) {
+    // When all the other frames are in flight, the one in the mailbox is about to be
+    // superseded anyway, so we take it back
+    frame = pool_try_get(&cam->pool);
+    if (frame == NULL && (frame = queue_remove(&p->ingest_q, frame_of_pool, &cam->pool)) != NULL)
+      cam->stats.dropped++;
+  }
+  if (frame == NULL && wait)
+    // Blocks while all of this camera's frames are in flight
+    frame = pool_get(&cam->pool);
+  return frame;
+}
+
+
+// Hands a frame that was just read to the preprocess stage. Returns -1 once the pipeline is
+// shutting down (the frame is then back in its pool)
+int submit_frame(pipeline_t *p, camera_t *cam, frame_t *frame)
+{
+  // Offline video frames are sampled at fixed media-time steps from the start of the file
+  frame->media_time = cam->stats.frames*p->frame_step;
+  cam->stats.frames++;
+  cam->stats.read_time += frame->read_time;
+
+  frame->cam_id       = cam->cam_id;
+  frame->capture_time = what_time_is_it_now();
+  frame->deadline     = frame->capture_time + cam->interval;
+  frame->priority     = cam->priority;
+  if (p->conf->use_input_stream) {
+    // The new frame supersedes the one still waiting in the mailbox, if any. It keeps that
+    // frame's deadline, as the camera has been waiting for inference since then
+    frame_t *stale = queue_remove(&p->ingest_q, frame_of_pool, &cam->pool);
+    if (stale != NULL) {
+      frame->deadline = stale->deadline;
+      cam->stats.dropped++;
+      pool_put(stale);
+    }
+  }
+  // There is room for a frame of every camera
+  if (queue_push(&p->ingest_q, frame) != 0) {
+    pool_put(frame);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Schedules the next reconnection attempt of a failed camera, doubling the wait every time
+void camera_backoff(camera_t *cam)
+{
+  printf("Reconnecting camera %d in %.0f sec\n", cam->cam_id, cam->backoff); fflush(stdout);
+  cam->retry_at = what_time_is_it_now() + cam->backoff;
+  cam->backoff  = (2*cam->backoff < RECONNECT_MAX) ? 2*cam->backoff : RECONNECT_MAX;
+}
+
+
+// Reopens a libav camera after a failed read, retrying with a longer wait after every failed
+// attempt until it succeeds. Returns -1 if TDS exits meanwhile
+int reopen_libav_camera(camera_t *cam)
+{
+  int status;
+  do {
+    camera_backoff(cam);
+    while (!exit_loop && what_time_is_it_now() < cam->retry_at)
+      usleep(100000);
+    if (exit_loop)
+      return -1;
+    cam->stats.reconnects++;
+    alloc_debug_arm(false);
+    status = libav_restart(cam->av);
+    alloc_debug_arm(true);
+  } while (status != 0);
+  return 0;
+}
+
+
+void reader_finished(pipeline_t *p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->active_readers--;
+  pthread_cond_signal(&p->reader_done);
+  pthread_mutex_unlock(&p->lock);
+}
+
+
+// Reader of a libav camera or of a file
+void *reader_thread(void *arg)
+{
+  camera_t *cam = arg;
+  pipeline_t *p = cam->pipeline;
+  double curr_time;
+  size_t size, frame_size;
+
+  cam->backoff = RECONNECT_MIN;
+  cam->healthy = true;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  alloc_debug_arm(true);
+
+  while (!exit_loop) {
+    frame_t *frame = camera_frame(p, cam, true);
+    if (frame == NULL)
+      break;
+
+    printf("Reading from camera %d (%p)\n", cam->cam_id, cam->av != NULL ? (void *)cam->av : (void *)cam->pipein); fflush(stdout);
+    curr_time = what_time_is_it_now();
+    size = read_frame(cam, frame, &frame_size);
+    frame->read_time = (what_time_is_it_now()-curr_time);
+    if (exit_loop) {
+      pool_put(frame);
+      break;
+    }
+
+    if (p->conf->use_input_video && size == 0) {
+      // End of the video file
+      pool_put(frame);
+      break;
+    }
+    if (size == 0 || size != frame_size) {
+      if (cam->av != NULL && libav_stalled(cam->av)) {
+        printf("Warning: camera %d sent no data for %.0f sec; marking it unhealthy\n", cam->cam_id, cam->stall_timeout);
+        fflush(stdout);
+        cam->stats.stalls++;
+        cam->healthy = false;
+      }
+      else {
+        printf("Warning: %zu bytes read from camera %d (expected: %zu)!\n", size, cam->cam_id, frame_size); fflush(stdout);
+        cam->stats.read_errors++;
+      }
+      pool_put(frame);
+      if (p->conf->use_input_image || p->conf->use_input_video)
+        break;
+      // Reopen only this camera; the other cameras keep being processed meanwhile
+      if (reopen_libav_camera(cam) != 0)
+        break;
+      continue;
+    }
+    cam->backoff = RECONNECT_MIN;
+    if (!cam->healthy) {
+      printf("Camera %d is sending data again\n", cam->cam_id); fflush(stdout);
+      cam->healthy = true;
+    }
+    if (submit_frame(p, cam, frame) != 0)
+      break;
+
+    // We just read one frame if we're reading from one single image file
+    if (p->conf->use_input_image)
+      break;
+  }
+
+  alloc_debug_arm(false);
+  cam->running = false;
+  reader_finished(p);
+
+  return NULL;
+}
+
+
+// Cameras decoded by ffmpeg are all read by the epoll ingest thread
+bool uses_ingest_thread(camera_t *cam)
+{
+  return cam->cmd[0] != '\0';
+}
+
+
+// A new frame header was read: the frame's pixel data goes to a free frame, grown to the
+// frame's size if needed, or is dropped if there is none
+void start_frame(pipeline_t *p, camera_t *cam, dim_t dim)
+{
+  if (dim.width != cam->dim.width || dim.height != cam->dim.height) {
+    printf("Camera %d: %dx%d frames\n", cam->cam_id, dim.width, dim.height); fflush(stdout);
+    cam->dim = dim;
+  }
+  if (cam->ppm.skipped > 0) {
+    printf("Warning: skipped %lu bytes of camera %d to find the next frame\n", cam->ppm.skipped, cam->cam_id);
+    cam->ppm.skipped = 0;
+  }
+  cam->frame_bytes = dim.width*dim.height*dim.c;
+  cam->in_frame    = true;
+  cam->filled      = 0;
+  cam->fill        = camera_frame(p, cam, false);
+  if (cam->fill != NULL && frame_reserve(cam->fill, cam->frame_bytes) != 0) {
+    pool_put(cam->fill);
+    cam->fill = NULL;
+  }
+  cam->discarding = (cam->fill == NULL);
+}
+
+
+// Reads whatever a camera's pipe holds without blocking, assembling frames as their bytes
+// arrive. Header bytes are read one at a time, so that no pixel data is read before we know
+// where it goes; they are a handful per frame. Bytes of a frame for which there is no free
+// frame are read and dropped, so the pipe keeps draining. Returns -1 at the end of the stream
+// or on a read error
+int ingest_camera(pipeline_t *p, camera_t *cam, unsigned char *scratch)
+{
+  int fd = fileno(cam->pipein);
+  unsigned char c;
+  dim_t dim;
+  ssize_t n;
+
+  while (true) {
+    if (!cam->in_frame)
+      n = read(fd, &c, 1);
+    else if (cam->discarding) {
+      size_t len = cam->frame_bytes - cam->filled;
+      n = read(fd, scratch, len < INGEST_CHUNK ? len : INGEST_CHUNK);
+    }
+    else
+      n = read(fd, cam->fill->data + cam->filled, cam->frame_bytes - cam->filled);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (n <= 0)
+      return -1;
+
+    cam->last_data = what_time_is_it_now();
+    if (!cam->healthy) {
+      printf("Camera %d is sending data again\n", cam->cam_id); fflush(stdout);
+      cam->healthy = true;
+    }
+    if (!cam->in_frame) {
+      if (ppm_header_feed(&cam->ppm, c, &dim)) {
+        start_frame(p, cam, dim);
+        cam->fill_start = cam->last_data;
+      }
+      continue;
+    }
+    cam->filled += n;
+    if (cam->filled < cam->frame_bytes)
+      continue;
+
+    cam->in_frame = false;
+    cam->backoff  = RECONNECT_MIN;
+    if (cam->discarding) {
+      cam->discarding = false;
+      cam->stats.dropped++;
+      continue;
+    }
+    frame_t *frame = cam->fill;
+    cam->fill = NULL;
+    frame->width     = cam->dim.width;
+    frame->height    = cam->dim.height;
+    frame->read_time = cam->last_data - cam->fill_start;
+    if (submit_frame(p, cam, frame) != 0)
+      return -1;
+  }
+}
+
+
+// Adds a camera's pipe to the epoll set; the camera has stall_timeout seconds to send data
+int watch_camera(int epfd, camera_t *cam)
+{
+  int fd = fileno(cam->pipein);
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = cam};
+  if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    return -1;
+  cam->last_data = what_time_is_it_now();
+  cam->healthy   = true;
+  return 0;
+}
+
+
+// Stops a failed camera's ffmpeg and schedules its reconnection. A partial frame is dropped,
+// and the new stream is read from its first header
+void drop_camera(int epfd, camera_t *cam)
+{
+  if (cam->pipein != NULL) {
+    epoll_ctl(epfd, EPOLL_CTL_DEL, fileno(cam->pipein), NULL);
+    kill(cam->pid, SIGKILL);
+    cam->stats.decode_cpu += close_pipe(cam->pipein, cam->pid);
+    cam->pipein = NULL;
+  }
+  if (cam->fill != NULL) {
+    pool_put(cam->fill);
+    cam->fill = NULL;
+  }
+  ppm_header_reset(&cam->ppm);
+  cam->in_frame   = false;
+  cam->filled     = 0;
+  cam->discarding = false;
+  cam->healthy    = false;
+  camera_backoff(cam);
+}
+
+
+// Starts a failed camera's ffmpeg again
+void reconnect_camera(int epfd, camera_t *cam)
+{
+  printf("Reconnecting camera %d (%s)\n", cam->cam_id, cam->url); fflush(stdout);
+  cam->stats.reconnects++;
+  cam->pipein = spawn_pipe(cam->cmd, &cam->pid);
+  if (cam->pipein == NULL || watch_camera(epfd, cam) != 0) {
+    printf("Warning: cannot restart camera %d\n", cam->cam_id);
+    drop_camera(epfd, cam);
+  }
+}
+
+
+// Multiplexes the pipes of all the ffmpeg cameras. A camera that stops sending data only
+// holds back its own frames: after its stall_timeout it is reported as unhealthy and its
+// ffmpeg is restarted, with an exponential backoff between attempts, while the other cameras
+// keep being read and the network stays loaded
+void *ingest_thread(void *arg)
+{
+  pipeline_t *p = arg;
+  struct epoll_event events[INGEST_EVENTS];
+  unsigned char *scratch = malloc(INGEST_CHUNK);
+  int i, n;
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0 || scratch == NULL) {
+    printf("ERROR: cannot set up the ingest of camera frames\n");
+    exit_loop = true;
+  }
+  for (i = 0; i < p->input->ncams && epfd >= 0; i++) {
+    camera_t *cam = &p->input->cams[i];
+    if (!uses_ingest_thread(cam)) continue;
+    cam->backoff = RECONNECT_MIN;
+    if (cam->pipein == NULL || watch_camera(epfd, cam) != 0)
+      drop_camera(epfd, cam);
+  }
+
+  alloc_debug_arm(true);
+  while (!exit_loop) {
+    n = epoll_wait(epfd, events, INGEST_EVENTS, INGEST_POLL_MS);
+    for (i = 0; i < n; i++) {
+      camera_t *cam = events[i].data.ptr;
+      if (cam->pipein == NULL || ingest_camera(p, cam, scratch) == 0)
+        continue;
+      if (exit_loop)
+        break;
+      printf("Warning: camera %d stopped sending frames (%zu bytes of a frame read)\n", cam->cam_id, cam->filled);
+      fflush(stdout);
+      cam->stats.read_errors++;
+      alloc_debug_arm(false);
+      drop_camera(epfd, cam);
+      alloc_debug_arm(true);
+    }
+
+    double now = what_time_is_it_now();
+    for (i = 0; i < p->input->ncams && !exit_loop; i++) {
+      camera_t *cam = &p->input->cams[i];
+      if (!uses_ingest_thread(cam)) continue;
+      alloc_debug_arm(false);
+      if (cam->pipein == NULL && now >= cam->retry_at)
+        reconnect_camera(epfd, cam);
+      else if (cam->pipein != NULL && now - cam->last_data > cam->stall_timeout) {
+        printf("Warning: camera %d sent no data for %.0f sec; marking it unhealthy\n", cam->cam_id, now - cam->last_data);
+        fflush(stdout);
+        cam->stats.stalls++;
+        drop_camera(epfd, cam);
+      }
+      alloc_debug_arm(true);
+    }
+  }
+  alloc_debug_arm(false);
+
+  for (i = 0; i < p->input->ncams; i++) {
+    camera_t *cam = &p->input->cams[i];
+    if (cam->fill != NULL) {
+      pool_put(cam->fill);
+      cam->fill = NULL;
+    }
+    cam->running = false;
+  }
+  if (epfd >= 0)
+    close(epfd);
+  free(scratch);
+  reader_finished(p);
+
+  return NULL;
+}
+
+
+// Image-directory mode: several of these threads take the next image of the list, decode it and
+// letterbox it, so that decoding runs ahead of inference. Frames skip the preprocess stage
+void *image_decoder_thread(void *arg)
+{
+  pipeline_t *p = arg;
+  camera_t *cam = &p->input->cams[0];
+  network *net = p->net;
+  cam_stats_t stats = {0};
+  float *part = NULL;
+  size_t part_size = 0;
+  unsigned char *rgb;
+  int w, h;
+  double curr_time;
+  int i;
+
+  alloc_debug_arm(true);
+  while (!exit_loop) {
+    i = __atomic_fetch_add(&p->next_image, 1, __ATOMIC_RELAXED);
+    if (i >= p->images.count)
+      break;
+    char *path = p->images.paths[i];
+
+    frame_t *frame = pool_get(&cam->pool);
+    if (frame == NULL)
+      break;
+
+    curr_time = what_time_is_it_now();
+    // Files that cannot be read or decoded (truncated, corrupt, not an image) are skipped.
+    // stb_image allocates while decoding, so it is left out of the accounting; the decoded
+    // image then goes into the frame's own buffer
+    alloc_debug_arm(false);
+    rgb = image_file_load(path, &w, &h);
+    alloc_debug_arm(true);
+    if (rgb == NULL) {
+      printf("Warning: cannot read image %s\n", path); fflush(stdout);
+      stats.read_errors++;
+      pool_put(frame);
+      continue;
+    }
+    if (reserve_buffer((void **)&frame->im.data, &frame->im_size, sizeof(float)*w*h*3) != 0) {
+      image_file_free(rgb);
+      stats.read_errors++;
+      pool_put(frame);
+      continue;
+    }
+    frame->im.w = w;
+    frame->im.h = h;
+    frame->im.c = 3;
+    convert_rgb24_to_planar(rgb, frame->im.data, w*h);
+    image_file_free(rgb);
+    frame->read_time = (what_time_is_it_now()-curr_time);
+
+    curr_time = what_time_is_it_now();
+    // Scratch space of the letterbox resize grows with the tallest image so far
+    if (reserve_buffer((void **)&part, &part_size, sizeof(float)*net->w*frame->im.h*frame->im.c) != 0) {
+      stats.read_errors++;
+      pool_put(frame);
+      continue;
+    }
+    letterbox_image_into(frame->im, part, frame->sized);
+    frame->conversion_time = (what_time_is_it_now()-curr_time);
+
+    frame->cam_id       = cam->cam_id;
+    frame->width        = frame->im.w;
+    frame->height       = frame->im.h;
+    frame->name         = path;
+    frame->capture_time = what_time_is_it_now();
+    stats.frames++;
+    stats.read_time += frame->read_time;
+    if (queue_push(&p->infer_q, frame) != 0) {
+      pool_put(frame);
+      break;
+    }
+  }
+  alloc_debug_arm(false);
+  free(part);
+
+  pthread_mutex_lock(&p->lock);
+  cam->stats.frames      += stats.frames;
+  cam->stats.read_errors += stats.read_errors;
+  cam->stats.read_time   += stats.read_time;
+  p->active_readers--;
+  pthread_cond_signal(&p->reader_done);
+  pthread_mutex_unlock(&p->lock);
+
+  return NULL;
+}
+
+
+// Static scenes are not worth a forward pass. A frame is classified if enough of it changed
+// since the camera's last classified frame (moved is then true), or if motion_refresh seconds
+// went by since then
+bool frame_has_motion(camera_t *cam, frame_t *frame, bool *moved)
+{
+  float changed = motion_measure(&cam->motion, frame->data, frame->width, frame->height);
+  *moved = (changed >= cam->motion_threshold);
+  if (!*moved && frame->capture_time - cam->last_inference < cam->motion_refresh)
+    return false;
+  motion_accept(&cam->motion, frame->width, frame->height);
+  cam->last_inference = frame->capture_time;
+  return true;
+}
+
+
+// Letterboxing a large frame to the network size makes distant objects a few pixels tall. In
+// motion-ROI mode the changed regions of the frame are classified instead, cropped from the
+// full-resolution frame. Regions smaller than the network input are grown to its size (as far
+// as the frame allows), for context, and so that they are not magnified. Returns the number of
+// crops, or 0 when the whole frame is cheaper: more regions than motion_crops, or regions that
+// cover half the frame
+int select_crops(camera_t *cam, frame_t *frame)
+{
+  int n = motion_regions(&cam->motion, frame->width, frame->height, frame->regions, cam->motion_crops);
+  long area = 0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    region_t *r = &frame->regions[i];
+    if (r->w < frame->sized.w) {
+      int w = (frame->sized.w < frame->width) ? frame->sized.w : frame->width;
+      r->x -= (w - r->w)/2;
+      r->x  = (r->x < 0) ? 0 : (r->x + w > frame->width) ? frame->width - w : r->x;
+      r->w  = w;
+    }
+    if (r->h < frame->sized.h) {
+      int h = (frame->sized.h < frame->height) ? frame->sized.h : frame->height;
+      r->y -= (h - r->h)/2;
+      r->y  = (r->y < 0) ? 0 : (r->y + h > frame->height) ? frame->height - h : r->y;
+      r->h  = h;
+    }
+    area += (long)r->w*r->h;
+  }
+  return (n > 0 && 2*area < (long)frame->width*frame->height) ? n : 0;
+}
+
+
+// High-resolution cameras can be classified as overlapping tiles, each letterboxed to the network
+// size on its own, to find smaller objects with the same network. Returns the number of tiles
+int select_tiles(camera_t *cam, frame_t *frame)
+{
+  int cols = cam->tile_cols, rows = cam->tile_rows;
+  // Tiles are the same size, and overlap by tile_overlap of it
+  int w = ceil(frame->width/(cols - (cols-1)*cam->tile_overlap));
+  int h = ceil(frame->height/(rows - (rows-1)*cam->tile_overlap));
+  int r, c;
+
+  w = (w < frame->width) ? w : frame->width;
+  h = (h < frame->height) ? h : frame->height;
+  for (r = 0; r < rows; r++)
+    for (c = 0; c < cols; c++) {
+      region_t *tile = &frame->regions[r*cols + c];
+      tile->x = (cols > 1) ? c*(frame->width - w)/(cols-1) : 0;
+      tile->y = (rows > 1) ? r*(frame->height - h)/(rows-1) : 0;
+      tile->w = w;
+      tile->h = h;
+    }
+  return rows*cols;
+}
+
+
+// Converts and letterboxes the crops of a frame, with the preprocess stage's scratch buffers
+int letterbox_crops(frame_t *frame, image *im, size_t *im_size, float **part, size_t *part_size, float **row,
+                    size_t *row_size)
+{
+  int i;
+  for (i = 0; i < frame->ncrops; i++) {
+    region_t *r = &frame->regions[i];
+    if (reserve_buffer((void **)&im->data, im_size, sizeof(float)*r->w*r->h*3) != 0 ||
+        reserve_buffer((void **)part, part_size, sizeof(float)*frame->sized.w*r->h*3) != 0 ||
+        reserve_buffer((void **)row, row_size, sizeof(float)*r->w*3) != 0)
+      return -1;
+    im->w = r->w;
+    im->h = r->h;
+    im->c = 3;
+    convert_rgb24_region_to_image(frame->data + 3*((size_t)r->y*frame->width + r->x), frame->width, *im, *row);
+    letterbox_image_into(*im, *part, frame->crops[i]);
+  }
+  return 0;
+}
+
+
+void *preprocess_thread(void *arg)
+{
+  pipeline_t *p = arg;
+  frame_t *frame;
+  double curr_time;
+
+  // Scratch buffers reused for every frame, grown with the largest frame seen: the float image
+  // and the intermediate of the letterbox resize (not needed when ffmpeg already scaled the frame),
+  // and a converted row of the motion-ROI crops
+  image im    = {0};
+  float *part = NULL, *row = NULL;
+  size_t im_size = 0, part_size = 0, row_size = 0;
+
+  alloc_debug_arm(true);
+  while ((frame = queue_pop(&p->ingest_q)) != NULL) {
+    curr_time = what_time_is_it_now();
+    camera_t *cam = &p->input->cams[frame->cam_id-1];
+    bool moved = false;
+    if (cam->track_interval > 1 && cam->tracked < cam->track_interval-1 && !cam->track_lost) {
+      // Between detections the inference stage moves the camera's tracks to the frame
+      cam->tracked++;
+      frame->carried = frame->tracked = true;
+      frame->conversion_time = (what_time_is_it_now()-curr_time);
+      if (queue_push(&p->infer_q, frame) != 0)
+        pool_put(frame);
+      continue;
+    }
+    if (cam->motion_threshold > 0 && !frame_has_motion(cam, frame, &moved)) {
+      // The inference stage gives it the camera's last detections, in order with its other frames
+      frame->carried = true;
+      frame->conversion_time = (what_time_is_it_now()-curr_time);
+      if (queue_push(&p->infer_q, frame) != 0)
+        pool_put(frame);
+      continue;
+    }
+    cam->tracked    = 0;
+    cam->track_lost = false;
+    if (cam->tile_cols > 0)
+      frame->ncrops = select_tiles(cam, frame);
+    else if (cam->motion_crops > 0 && moved)
+      frame->ncrops = select_crops(cam, frame);
+    if (frame->ncrops > 0) {
+      if (letterbox_crops(frame, &im, &im_size, &part, &part_size, &row, &row_size) != 0) {
+        pool_put(frame);
+        continue;
+      }
+      frame->conversion_time = (what_time_is_it_now()-curr_time);
+      if (queue_push(&p->infer_q, frame) != 0)
+        pool_put(frame);
+      continue;
+    }
+    // Cameras may have different sizes, and change size while we run
+    bool scaled = p->conf->prescale && frame->width <= frame->sized.w && frame->height <= frame->sized.h;
+    if (reserve_buffer((void **)&im.data, &im_size, sizeof(float)*frame->width*frame->height*3) != 0 ||
+        (!scaled && reserve_buffer((void **)&part, &part_size, sizeof(float)*frame->sized.w*frame->height*3) != 0)) {
+      pool_put(frame);
+      continue;
+    }
+    im.w = frame->width;
+    im.h = frame->height;
+    im.c = 3;
+    convert_rgb24_to_planar(frame->data, im.data, im.w*im.h);
+    if (scaled)
+      embed_image_into(im, frame->sized);
+    else
+      letterbox_image_into(im, part, frame->sized);
+    frame->conversion_time = (what_time_is_it_now()-curr_time);
+
+    if (queue_push(&p->infer_q, frame) != 0)
+      pool_put(frame);
+  }
+  alloc_debug_arm(false);
+  queue_close(&p->infer_q);
+  free_image(im);
+  free(part);
+  free(row);
+
+  return NULL;
+}
 
-// The application supports up to 6 input streams
-typedef struct {
-  FILE *pipein_1;
-  FILE *pipein_2;
-  FILE *pipein_3;
-  FILE *pipein_4;
-  FILE *pipein_5;
-  FILE *pipein_6;
-} input_t;
 
+// Exported by libdarknet but not declared in darknet.h. Unlike get_network_boxes(), they let
+// us fill the detections preallocated in each frame
+int num_detections(network *net, float thresh);
+void fill_network_boxes(network *net, int w, int h, float thresh, float hier, int *map, int relative, detection *dets);
 
-int parse_config_file(char *filename, conf_params_t *conf_params)
+
+// Darknet only extracts the boxes of the first image in a batch, so we temporarily point the
+// output of the detection layers at image b of the batch (and back, with -b)
+void select_batch_output(network *net, int b)
 {
-  printf("Config file:   %s\n", filename);
+  int i;
+  for (i = 0; i < net->n; ++i)
+    if (net->layers[i].type == YOLO || net->layers[i].type == REGION || net->layers[i].type == DETECTION)
+      net->layers[i].output += b*net->layers[i].outputs;
+}
 
-  FILE *f = fopen(filename, "rb");
-  if (f == NULL) {
-      printf("ERROR: cannot open %s\n", filename);
-      return -1;
-  }
-  fseek(f, 0, SEEK_END);
-  long fsize = ftell(f);
-  fseek(f, 0, SEEK_SET);  /* same as rewind(f); */
-  char *string = malloc(fsize + 1);
-  fread(string, 1, fsize, f);
-  fclose(f);
-  string[fsize] = 0;
 
-  /* Mapping of JSON attributes to C my_object's struct members */
-  const struct json_attr_t json_attrs[] = {
-       {"darknet_home", t_string, .addr.string = conf_params->darknet_home, .len = sizeof(conf_params->darknet_home)},
-       {"darknet_datacfg", t_string, .addr.string = conf_params->darknet_datacfg, .len = sizeof(conf_params->darknet_datacfg)},
-       {"darknet_cfgfile", t_string, .addr.string = conf_params->darknet_cfgfile, .len = sizeof(conf_params->darknet_cfgfile)},
-       {"darknet_weightfile", t_string, .addr.string = conf_params->darknet_weightfile, .len = sizeof(conf_params->darknet_weightfile)},
-       {"input_stream_1", t_string, .addr.string = conf_params->input_stream_1, .len = sizeof(conf_params->input_stream_1)},
-       {"input_stream_2", t_string, .addr.string = conf_params->input_stream_2, .len = sizeof(conf_params->input_stream_2)},
-       {"input_stream_3", t_string, .addr.string = conf_params->input_stream_3, .len = sizeof(conf_params->input_stream_3)},
-       {"input_stream_4", t_string, .addr.string = conf_params->input_stream_4, .len = sizeof(conf_params->input_stream_4)},
-       {"input_stream_5", t_string, .addr.string = conf_params->input_stream_5, .len = sizeof(conf_params->input_stream_5)},
-       {"input_stream_6", t_string, .addr.string = conf_params->input_stream_6, .len = sizeof(conf_params->input_stream_6)},
-       {"input_image", t_string, .addr.string = conf_params->input_image, .len = sizeof(conf_params->input_image)},
-       {NULL},
-     };
+int fill_network_boxes_batch(network *net, int b, int w, int h, float thresh, float hier, detection *dets, int max_boxes)
+{
+  int nboxes;
+  select_batch_output(net, b);
+  nboxes = num_detections(net, thresh);
+  assert(nboxes <= max_boxes);
+  fill_network_boxes(net, w, h, thresh, hier, 0, 1, dets);
+  select_batch_output(net, -b);
+  return nboxes;
+}
 
-  /* Parse the JSON string from buffer */
-  int status = json_read_object(string, json_attrs, NULL);
-  if (status != 0) {
-    puts(json_error_string(status));
-    return -1;
-  }
 
-  conf_params->use_input_image  = false;
-  conf_params->use_input_stream = false;
+int num_detections_batch(network *net, int b, float thresh)
+{
+  int nboxes;
+  select_batch_output(net, b);
+  nboxes = num_detections(net, thresh);
+  select_batch_output(net, -b);
+  return nboxes;
+}
 
-  if (conf_params->input_image[0] != '\0')
-    // Use image file
-    conf_params->use_input_image = true;
-  else
-    if ((conf_params->input_stream_1[0] != '\0') || (conf_params->input_stream_2[0] != '\0') || (conf_params->input_stream_3[0] != '\0') ||
-	(conf_params->input_stream_4[0] != '\0') || (conf_params->input_stream_5[0] != '\0') || (conf_params->input_stream_6[0] != '\0') ) {
-      // Use RTSP video stream(s)
-      conf_params->use_input_stream = true;
-      conf_params->use_input_image  = false;
-    }
 
-  if (!conf_params->use_input_image && !conf_params->use_input_stream) {
-    printf("ERROR: both input_image and input_stream_* cannot be empty in the configuration file\n");
-    return -1;
-  }
+// Cascade: the inputs of the batch in which the first network found candidates are moved to
+// the front of input, and the confirming network runs on them alone. Returns how many they are
+int confirm_candidates(pipeline_t *p, float *input, int ninputs)
+{
+  network *net = p->net;
+  int s, m = 0;
 
-  return 0;
+  for (s = 0; s < ninputs; s++) {
+    if (num_detections_batch(net, s, p->candidate_thresh) == 0) {
+      p->confirm_slot[s] = -1;
+      continue;
+    }
+    if (m < s)
+      memcpy(input + m*net->inputs, input + s*net->inputs, sizeof(float)*net->inputs);
+    p->confirm_slot[s] = m++;
+  }
+  if (m == 0)
+    return 0;
+  if (p->max_inputs > 1)
+    set_batch_network(p->confirm_net, m);
+  network_predict(p->confirm_net, input);
+  if (p->max_inputs > 1)
+    set_batch_network(p->confirm_net, 1);
+  return m;
 }
 
 
-int get_input_dimensions(conf_params_t conf_params, dim_t *dimensions)
+// Boxes of network input b of the batch: the first network's, or the confirming network's
+// (none if the first one found no candidates there)
+int input_boxes(pipeline_t *p, int b, int w, int h, detection *dets, int max_boxes)
 {
-  char ffprobe_cmd[1024];
-  if (conf_params.use_input_image)
-    // Use image file
-    snprintf(ffprobe_cmd, 1024, FFPROBE_CMD, conf_params.input_image);
-  else
-    // Use RTSP video stream
-    if (conf_params.input_stream_1[0] != '\0')
-      snprintf(ffprobe_cmd, 1024, FFPROBE_CMD, conf_params.input_stream_1);
-    else if (conf_params.input_stream_2[0] != '\0')
-      snprintf(ffprobe_cmd, 1024, FFPROBE_CMD, conf_params.input_stream_2);
-    else if (conf_params.input_stream_3[0] != '\0')
-      snprintf(ffprobe_cmd, 1024, FFPROBE_CMD, conf_params.input_stream_3);
-    else if (conf_params.input_stream_4[0] != '\0')
-      snprintf(ffprobe_cmd, 1024, FFPROBE_CMD, conf_params.input_stream_4);
-    else if (conf_params.input_stream_5[0] != '\0')
-      snprintf(ffprobe_cmd, 1024, FFPROBE_CMD, conf_params.input_stream_5);
-    else if (conf_params.input_stream_6[0] != '\0')
-      snprintf(ffprobe_cmd, 1024, FFPROBE_CMD, conf_params.input_stream_6);
-
-  FILE * pipein = popen(ffprobe_cmd, "r");
-  if (pipein == NULL) {
-    printf("ERROR: failed to run ffprobe command\n" );
-    return -1;
-  }
-  char line[8];
-  fgets(line, sizeof(line), pipein);
-  dimensions->width = atoi(line);
-  fgets(line, sizeof(line), pipein);
-  dimensions->height = atoi(line);
-  printf("Dimensions:    %dx%d\n", dimensions->width, dimensions->height);
-  dimensions->c = 3;
-  pclose(pipein);
+  if (p->confirm_net == NULL)
+    return fill_network_boxes_batch(p->net, b, w, h, p->thresh, p->hier_thresh, dets, max_boxes);
+  if (p->confirm_slot[b] < 0)
+    return 0;
+  return fill_network_boxes_batch(p->confirm_net, p->confirm_slot[b], w, h, p->thresh, p->hier_thresh, dets, max_boxes);
+}
 
-  return 0;
+
+// A frame goes through the network as a whole, or as its motion-ROI crops
+int frame_inputs(frame_t *frame)
+{
+  return (frame->ncrops > 0) ? frame->ncrops : 1;
 }
 
 
-int open_input_pipes(conf_params_t conf_params, input_t *input)
+float *frame_input(frame_t *frame, int k)
 {
-  input->pipein_1 = NULL;
-  input->pipein_2 = NULL;
-  input->pipein_3 = NULL;
-  input->pipein_4 = NULL;
-  input->pipein_5 = NULL;
-  input->pipein_6 = NULL;
+  return (frame->ncrops > 0) ? frame->crops[k].data : frame->sized.data;
+}
 
-  char ffmpeg_cmd[1024];
-  if (conf_params.use_input_image) {
-    // Use image file
-    snprintf(ffmpeg_cmd, 1024, "ffmpeg -hide_banner -loglevel error -i %s -f image2pipe -vcodec rawvideo -pix_fmt rgb24 -", conf_params.input_image);
-    input->pipein_1 = popen(ffmpeg_cmd, "r");
-    // We just iterate once if we're reading from one single image file
-    exit_loop = true;
-  }
-  else {
-    // Use RTSP video stream 1
-    if (conf_params.input_stream_1[0] != '\0') {
-      snprintf(ffmpeg_cmd, 1024, FFMPEG_CMD, conf_params.input_stream_1);
-      input->pipein_1 = popen(ffmpeg_cmd, "r");
-    }
-    // Use RTSP video stream 2
-    if (conf_params.input_stream_2[0] != '\0') {
-      snprintf(ffmpeg_cmd, 1024, FFMPEG_CMD, conf_params.input_stream_2);
-      input->pipein_2 = popen(ffmpeg_cmd, "r");
-    }
-    // Use RTSP video stream 3
-    if (conf_params.input_stream_3[0] != '\0') {
-      snprintf(ffmpeg_cmd, 1024, FFMPEG_CMD, conf_params.input_stream_3);
-      input->pipein_3 = popen(ffmpeg_cmd, "r");
-    }
-    // Use RTSP video stream 4
-    if (conf_params.input_stream_4[0] != '\0') {
-      snprintf(ffmpeg_cmd, 1024, FFMPEG_CMD, conf_params.input_stream_4);
-      input->pipein_4 = popen(ffmpeg_cmd, "r");
-    }
-    // Use RTSP video stream 5
-    if (conf_params.input_stream_5[0] != '\0') {
-      snprintf(ffmpeg_cmd, 1024, FFMPEG_CMD, conf_params.input_stream_5);
-      input->pipein_5 = popen(ffmpeg_cmd, "r");
-    }
-    // Use RTSP video stream 6
-    if (conf_params.input_stream_6[0] != '\0') {
-      snprintf(ffmpeg_cmd, 1024, FFMPEG_CMD, conf_params.input_stream_6);
-      input->pipein_6 = popen(ffmpeg_cmd, "r");
-    }
-  }
 
-  printf("pipein_1 = %p\n", (void *)input->pipein_1);
-  printf("pipein_2 = %p\n", (void *)input->pipein_2);
-  printf("pipein_3 = %p\n", (void *)input->pipein_3);
-  printf("pipein_4 = %p\n", (void *)input->pipein_4);
-  printf("pipein_5 = %p\n", (void *)input->pipein_5);
-  printf("pipein_6 = %p\n", (void *)input->pipein_6);
+enum {CUT_LEFT = 1, CUT_RIGHT = 2, CUT_TOP = 4, CUT_BOTTOM = 8};
 
-  return 0;
+// Length of the intersection of two intervals (negative if they are apart)
+float interval_overlap(float a0, float a1, float b0, float b1)
+{
+  return ((a1 < b1) ? a1 : b1) - ((a0 > b0) ? a0 : b0);
 }
 
 
-void close_input_pipes(input_t input)
+// Most probable class of a detection (-1 if it was suppressed)
+int best_class(detection *det, int classes)
 {
-  // Flush and close input and output pipes
-  if (input.pipein_1 != NULL) {
-      fflush(input.pipein_1);
-      pclose(input.pipein_1);
-  }
-  if (input.pipein_2 != NULL) {
-      fflush(input.pipein_2);
-      pclose(input.pipein_2);
-  }
-  if (input.pipein_3 != NULL) {
-      fflush(input.pipein_3);
-      pclose(input.pipein_3);
-  }
-  if (input.pipein_4 != NULL) {
-      fflush(input.pipein_4);
-      pclose(input.pipein_4);
-  }
-  if (input.pipein_5 != NULL) {
-      fflush(input.pipein_5);
-      pclose(input.pipein_5);
-  }
-  if (input.pipein_6 != NULL) {
-      fflush(input.pipein_6);
-      pclose(input.pipein_6);
-  }
+  int c, best = -1;
+  for (c = 0; c < classes; c++)
+    if (det->prob[c] > 0 && (best < 0 || det->prob[c] > det->prob[best]))
+      best = c;
+  return best;
 }
 
 
-FILE *get_pipe(int i, input_t input)
+// An object on the seam between two crops (tiles, or motion regions) is found in both, often as
+// two partial boxes that overlap too little for NMS to tell they are one object. Boxes of the
+// same class from different crops are merged into their union when most of the smaller one
+// overlaps the other (the object was found twice where the crops overlap), or when both are cut
+// by facing edges of their crops and line up along them. crop_first[k] is the first box of crop
+// k, and cuts is scratch space for a flag per box
+void merge_crop_boxes(frame_t *frame, int *crop_first, int classes, unsigned char *cuts)
 {
-  switch (i) {
-    case 1: return input.pipein_1;
-    case 2: return input.pipein_2;
-    case 3: return input.pipein_3;
-    case 4: return input.pipein_4;
-    case 5: return input.pipein_5;
-    case 6: return input.pipein_6;
+  float mx = (float)SEAM_MARGIN/frame->width, my = (float)SEAM_MARGIN/frame->height;
+  int k, i, j, c;
+
+  // Edges of its crop, inside the frame, that cut each box
+  for (k = 0; k < frame->ncrops; k++) {
+    region_t *r = &frame->regions[k];
+    for (i = crop_first[k]; i < crop_first[k+1]; i++) {
+      box b = frame->dets[i].bbox;
+      cuts[i] = 0;
+      if (r->x > 0 && b.x - b.w/2 < (float)r->x/frame->width + mx)
+        cuts[i] |= CUT_LEFT;
+      if (r->x + r->w < frame->width && b.x + b.w/2 > (float)(r->x + r->w)/frame->width - mx)
+        cuts[i] |= CUT_RIGHT;
+      if (r->y > 0 && b.y - b.h/2 < (float)r->y/frame->height + my)
+        cuts[i] |= CUT_TOP;
+      if (r->y + r->h < frame->height && b.y + b.h/2 > (float)(r->y + r->h)/frame->height - my)
+        cuts[i] |= CUT_BOTTOM;
+    }
   }
-  assert(0);
+
+  for (k = 0; k < frame->ncrops; k++)
+    for (i = crop_first[k]; i < crop_first[k+1]; i++) {
+      detection *a = &frame->dets[i];
+      int class = best_class(a, classes);
+      if (class < 0)
+        continue;
+      for (j = crop_first[k+1]; j < crop_first[frame->ncrops]; j++) {
+        detection *b = &frame->dets[j];
+        if (best_class(b, classes) != class)
+          continue;
+        float ix = interval_overlap(a->bbox.x - a->bbox.w/2, a->bbox.x + a->bbox.w/2, b->bbox.x - b->bbox.w/2, b->bbox.x + b->bbox.w/2);
+        float iy = interval_overlap(a->bbox.y - a->bbox.h/2, a->bbox.y + a->bbox.h/2, b->bbox.y - b->bbox.h/2, b->bbox.y + b->bbox.h/2);
+        if (ix < -mx || iy < -my)
+          continue;
+        float min_w = fminf(a->bbox.w, b->bbox.w), min_h = fminf(a->bbox.h, b->bbox.h);
+        bool twice = ix > 0 && iy > 0 && ix*iy > MERGE_OVERLAP*fminf(a->bbox.w*a->bbox.h, b->bbox.w*b->bbox.h);
+        bool seam  = ((((cuts[i] & CUT_RIGHT) && (cuts[j] & CUT_LEFT)) || ((cuts[i] & CUT_LEFT) && (cuts[j] & CUT_RIGHT))) &&
+                      iy > MERGE_OVERLAP*min_h) ||
+                     ((((cuts[i] & CUT_BOTTOM) && (cuts[j] & CUT_TOP)) || ((cuts[i] & CUT_TOP) && (cuts[j] & CUT_BOTTOM))) &&
+                      ix > MERGE_OVERLAP*min_w);
+        if (!twice && !seam)
+          continue;
+
+        float left   = fminf(a->bbox.x - a->bbox.w/2, b->bbox.x - b->bbox.w/2);
+        float right  = fmaxf(a->bbox.x + a->bbox.w/2, b->bbox.x + b->bbox.w/2);
+        float top    = fminf(a->bbox.y - a->bbox.h/2, b->bbox.y - b->bbox.h/2);
+        float bottom = fmaxf(a->bbox.y + a->bbox.h/2, b->bbox.y + b->bbox.h/2);
+        a->bbox = (box){(left + right)/2, (top + bottom)/2, right - left, bottom - top};
+        a->objectness = fmaxf(a->objectness, b->objectness);
+        for (c = 0; c < classes; c++) {
+          a->prob[c] = fmaxf(a->prob[c], b->prob[c]);
+          b->prob[c] = 0;
+        }
+        b->objectness = 0;
+        // The merged box can still meet a box of a third crop
+        cuts[i] |= cuts[j];
+      }
+    }
 }
 
 
-void sig_handler(int signo)
+// Extracts the boxes of a frame whose network inputs start at input first of the batch. The
+// boxes of a crop are relative to the crop, and are mapped back to the frame, where the boxes
+// of an object split between crops are merged
+int frame_boxes(pipeline_t *p, frame_t *frame, int first, unsigned char *cuts)
 {
-  if (signo == SIGINT) {
-    exit_loop = true;
-    fflush(stdout);
-    fflush(stderr);
+  int crop_first[MAX_CROPS+1];
+  int nboxes = 0, k, i;
+
+  if (frame->ncrops == 0)
+    return input_boxes(p, first, frame->width, frame->height, frame->dets, frame->max_boxes);
+  for (k = 0; k < frame->ncrops; k++) {
+    region_t *r = &frame->regions[k];
+    detection *dets = frame->dets + nboxes;
+    crop_first[k] = nboxes;
+    int n = input_boxes(p, first+k, r->w, r->h, dets, frame->max_boxes - nboxes);
+    for (i = 0; i < n; i++) {
+      box *bbox = &dets[i].bbox;
+      bbox->x = (r->x + bbox->x*r->w)/frame->width;
+      bbox->y = (r->y + bbox->y*r->h)/frame->height;
+      bbox->w = bbox->w*r->w/frame->width;
+      bbox->h = bbox->h*r->h/frame->height;
+    }
+    nboxes += n;
   }
+  crop_first[frame->ncrops] = nboxes;
+  merge_crop_boxes(frame, crop_first, p->meta.classes, cuts);
+  return nboxes;
 }
 
 
-void print_usage(char * pname)
+void *infer_thread(void *arg)
 {
-  printf("Usage: %s <OPTIONS>\n", pname);
-  printf(" OPTIONS:\n");
-  printf("    -h          : print this helpful usage info\n");
-  printf("    -c <file>   : JSON configuration file to use\n");
-  printf("    -d <dir>    : directory for this run (i.e. where all logs and output will be placed)\n");
-  printf("                :      Optional (default: current directory)\n");
-  printf("    -l <file>   : global log file where we append the classification results during the run\n");
-  printf("                :      Optional (default: no global logging)\n");
-  printf("    -i <id>     : integer id to assign to this run\n");
-  printf("                :      Optional (default: 0)\n");
+  pipeline_t *p = arg;
+  network *net = p->net;
+  int batch_size = p->conf->batch_size;
+  frame_t **batch = malloc(sizeof(frame_t *)*batch_size);
+  int *first = malloc(sizeof(int)*batch_size);  // First network input of each frame of the batch
+  unsigned char *cuts = malloc(p->max_boxes*p->max_inputs);  // Room for any frame's boxes
+  float *X = (p->max_inputs > 1) ? malloc(sizeof(float)*p->max_inputs*net->inputs) : NULL;
+  struct timespec deadline;
+  double curr_time, prediction_time = 0;
+  int n, ninfer, ninputs, b, k;
+
+  alloc_debug_arm(true);
+  while ((batch[0] = queue_pop(&p->infer_q)) != NULL) {
+
+    // Collect frames from any camera until the batch is full or batch_wait_ms have elapsed. A
+    // static frame ends the batch: it must get the detections of the frames inferred before it
+    n = 1;
+    if (batch_size > 1 && !batch[0]->carried) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec  += p->conf->batch_wait_ms / 1000;
+      deadline.tv_nsec += (p->conf->batch_wait_ms % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      while (n < batch_size && (batch[n] = queue_pop_timed(&p->infer_q, &deadline)) != NULL)
+        if (batch[n++]->carried)
+          break;
+    }
+    ninfer = batch[n-1]->carried ? n-1 : n;
+
+    curr_time = what_time_is_it_now();
+    ninputs = 0;
+    for (b = 0; b < ninfer; b++) {
+      cam_stats_t *stats = &p->input->cams[batch[b]->cam_id-1].stats;
+      first[b] = ninputs;
+      ninputs += frame_inputs(batch[b]);
+      batch[b]->age = curr_time - batch[b]->capture_time;
+      stats->inferred++;
+      if (batch[b]->ncrops > 0)
+        stats->cropped++;
+      stats->age_sum += batch[b]->age;
+      if (batch[b]->age > stats->age_max)
+        stats->age_max = batch[b]->age;
+    }
+    if (ninfer > 0) {
+      float *input = batch[0]->sized.data;
+      if (p->max_inputs > 1) {
+        for (b = 0; b < ninfer; b++)
+          for (k = 0; k < frame_inputs(batch[b]); k++)
+            memcpy(X + (first[b]+k)*net->inputs, frame_input(batch[b], k), sizeof(float)*net->inputs);
+        input = X;
+        // A partial batch only computes the images we actually have
+        set_batch_network(net, ninputs);
+      }
+      network_predict(net, input);
+      if (p->max_inputs > 1)
+        // Darknet's YOLO layer treats a batch of 2 as a flipped image pair when extracting boxes
+        set_batch_network(net, 1);
+      if (p->confirm_net != NULL && confirm_candidates(p, input, ninputs) > 0)
+        for (b = 0; b < ninfer; b++)
+          for (k = 0; k < frame_inputs(batch[b]); k++)
+            if (p->confirm_slot[first[b]+k] >= 0) {
+              p->input->cams[batch[b]->cam_id-1].stats.candidates++;
+              break;
+            }
+      // The forward passes are shared by the whole batch, so each frame is charged its inputs' share
+      prediction_time = (what_time_is_it_now()-curr_time)/ninputs;
+    }
+
+    for (b = 0; b < n; b++) {
+      frame_t *frame = batch[b];
+      camera_t *cam  = &p->input->cams[frame->cam_id-1];
+      if (frame->carried) {
+        if (frame->tracked)
+          cam->stats.tracked++;
+        else
+          cam->stats.skipped++;
+        if (cam->track_interval > 0) {
+          bool lost;
+          frame->nboxes = tracker_predict(&cam->tracker, frame->capture_time, frame->dets, frame->max_boxes,
+                                          p->meta.classes, &lost);
+          if (lost)
+            cam->track_lost = true;
+        }
+        else {
+          copy_detections(net, frame->dets, cam->last_dets, cam->last_nboxes);
+          frame->nboxes = cam->last_nboxes;
+        }
+        frame->age             = curr_time - frame->capture_time;
+        frame->prediction_time = 0;
+        frame->boxing_time     = 0;
+        if (queue_push(&p->output_q, frame) != 0)
+          pool_put(frame);
+        continue;
+      }
+      frame->prediction_time = prediction_time*frame_inputs(frame);
+
+      // Boxes must be extracted before the next prediction overwrites the network output
+      curr_time = what_time_is_it_now();
+      frame->nboxes = frame_boxes(p, frame, first[b], cuts);
+      if (p->nms) do_nms_sort(frame->dets, frame->nboxes, p->meta.classes, p->nms);
+      if (cam->track_interval > 0)
+        frame->nevents = tracker_update(&cam->tracker, frame->capture_time, frame->dets, frame->nboxes,
+                                        p->meta.classes, frame->events);
+      else if (cam->last_dets != NULL) {
+        copy_detections(net, cam->last_dets, frame->dets, frame->nboxes);
+        cam->last_nboxes = frame->nboxes;
+      }
+      frame->boxing_time = (what_time_is_it_now()-curr_time);
+
+      if (queue_push(&p->output_q, frame) != 0)
+        pool_put(frame);
+    }
+  }
+  alloc_debug_arm(false);
+  queue_close(&p->output_q);
+  free(batch);
+  free(first);
+  free(cuts);
+  free(X);
+
+  return NULL;
 }
 
 
-void to_json_string(short sequence[CAMS][CATEGS], char *sequence_str)
+void *output_thread(void *arg)
 {
+  pipeline_t *p = arg;
+  frame_t *frame;
   time_t timestamp;
-  int cam, categ;
-  char tmp[10];
+  char outfile[300];
+  int i, j;
 
-  time(&timestamp);
+  alloc_debug_arm(true);
+  while ((frame = queue_pop(&p->output_q)) != NULL) {
+    // A frame whose results come after the camera's next sample was due missed its deadline
+    camera_t *cam = &p->input->cams[frame->cam_id-1];
+    if (cam->interval > 0 && what_time_is_it_now() > frame->deadline)
+      cam->stats.missed_deadlines++;
 
-  sprintf(sequence_str, "{\"id\":%d,\"ts\":%ld,", tds_id, timestamp);
-  for (cam=0; cam<CAMS; cam++) {
-    strcat(sequence_str, "\"");
-    sprintf(tmp, "%d", cam+1);
-    strcat(sequence_str, tmp);
-    strcat(sequence_str, "\":[");
-    for (categ=0; categ<CATEGS; categ++)
-      if (sequence[cam][categ] != -1) {
-        //strcat(sequence_str, "\"");
-        sprintf(tmp, "%d", coco_ids[categ]);
-        strcat(sequence_str, tmp);
-        strcat(sequence_str, ",");
-        //strcat(sequence_str, "\",");
+    /*************************************************************************************/
+    /* Show signs of life                                                                */
+    /*************************************************************************************/
+    supervisor_heartbeat();
+
+    if (p->seen[frame->cam_id-1]) {
+      // This camera already reported in the current "sequence". We keep all the classification
+      // results for a given sequence together for logging convenience, so we dump the previous
+      // sequence to the global logfile (if specified) in JSON format and start a new one
+      if (p->fp_log != NULL) {
+        to_json_string(p->sequence, p->input->ncams, p->sequence_str);
+        fprintf(p->fp_log, "%s\n", p->sequence_str);
+        fflush(p->fp_log);
+      }
+      int cam, categ;
+      for (cam=0; cam<p->input->ncams; cam++) {
+	for (categ=0; categ<CATEGS; categ++)
+	  p->sequence[cam][categ] = -1;
+	p->seen[cam] = false;
+      }
+    }
+    p->seen[frame->cam_id-1] = true;
+
+
+    /*************************************************************************************/
+    /* Write log and images                                                              */
+    /*************************************************************************************/
+    time(&timestamp);
+    bool object_detected = false;
+    for(i = 0; i < frame->nboxes; ++i){
+      for(j = 0; j < p->meta.classes; ++j) {
+	if (frame->dets[i].prob[j]) {
+          // Logging to text file (images are identified by their file rather than the camera)
+          if (frame->name != NULL)
+            fprintf(p->fp_pred, "%s,", frame->name);
+          else
+            fprintf(p->fp_pred, "%d,", frame->cam_id);
+          if (p->conf->use_input_video)
+            fprintf(p->fp_pred, "%.3f,", frame->media_time);
+          else
+            fprintf(p->fp_pred, "%ld,", timestamp);
+	  fprintf(p->fp_pred, "%d,%s,%.4f,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+                                          coco_ids[j],
+					  p->names[j],
+					  frame->dets[i].prob[j],
+					  frame->read_time,
+					  frame->conversion_time,
+					  frame->prediction_time,
+					  frame->boxing_time,
+					  frame->age
+					  );
+	  p->sequence[frame->cam_id-1][j] = 1;
+	  object_detected = true;
+	}
+      }
+    }
+
+    // Tracked cameras also log the objects that came and went, once each
+    for (i = 0; i < frame->nevents; i++) {
+      track_event_t *event = &frame->events[i];
+      fprintf(p->fp_events, "%d,%ld,%s,%d,%d,%s,%.4f,%.4f,%.4f,%.4f,%.4f,%.3f\n", frame->cam_id, timestamp,
+              event->enter ? "enter" : "exit", event->track_id, coco_ids[event->categ], p->names[event->categ],
+              event->prob, event->bbox.x, event->bbox.y, event->bbox.w, event->bbox.h, event->duration);
+    }
+
+    if (object_detected && !frame->carried) {
+      // We just log images where objects were detected, and not again for a static scene.
+      // Drawing labels and encoding the image allocate inside Darknet, so this is left out of
+      // the allocation accounting
+      alloc_debug_arm(false);
+      image snapshot = {0};
+      if (frame->im.data != NULL) {
+        // Image-directory mode: draw on the decoded image and name the snapshot after its file
+        const char *base = strrchr(frame->name, '/') ? strrchr(frame->name, '/')+1 : frame->name;
+        const char *ext  = strrchr(base, '.');
+        snapshot = frame->im;
+        snprintf(outfile, 270, "img_%05ld_%.*s", p->count, ext ? (int)(ext-base) : (int)strlen(base), base);
+      }
+      else if (reserve_buffer((void **)&p->snapshot.data, &p->snapshot_size, sizeof(float)*frame->width*frame->height*3) == 0) {
+        // In prescale mode the snapshot is at the scaled resolution on purpose: the source size
+        // is never seen (the decoder only delivers scaled frames), and the boxes, fractions of the
+        // frame, apply to the source frame all the same since scaling keeps the aspect ratio
+        p->snapshot.w = frame->width;
+        p->snapshot.h = frame->height;
+        p->snapshot.c = 3;
+        snapshot = p->snapshot;
+        convert_rgb24_to_planar(frame->data, snapshot.data, snapshot.w*snapshot.h);
+        snprintf(outfile, 270, "cam_%d_frame_%05ld", frame->cam_id, p->count);
+      }
+      if (snapshot.data != NULL) {
+        draw_detections(snapshot, frame->dets, frame->nboxes, p->thresh, p->names, p->alphabet, p->meta.classes);
+        save_image(snapshot, outfile);
       }
-    if (sequence_str[strlen(sequence_str)-1] == ',')
-      sequence_str[strlen(sequence_str)-1] = '\0';  // Remove last comma
-    strcat(sequence_str, "],");
+      alloc_debug_arm(true);
+    }
+
+    pool_put(frame);
+    if (p->count == 0) {
+      printf("First frame classified %.3f sec after startup\n", what_time_is_it_now() - p->launch_time);
+      fflush(stdout);
+    }
+    p->count++;
+
+    fflush(stdout);
+    fflush(stderr);
+    fflush(p->fp_pred);
+    if (p->fp_events != NULL)
+      fflush(p->fp_events);
   }
-  sequence_str[strlen(sequence_str)-1] = '\0';  // Remove last comma
-  strcat(sequence_str, "}");
+  alloc_debug_arm(false);
+
+  return NULL;
 }
 
 
 int main(int argc, char *argv[])
 {
 
+  double launch_time = what_time_is_it_now();
   char confile[256];
   char dirname[256];
   char logfile[256];
   confile[0] = '\0';
   logfile[0] = '\0';
   strcpy(dirname, ".");
+  bool supervisor = false;
+  double watchdog = WATCHDOG_TIMEOUT;
   int option;
 
   printf("------------------------------------------------------------------------------------\n");
@@ -355,7 +2029,7 @@ int main(int argc, char *argv[])
   printf("------------------------------------------------------------------------------------\n\n");
   fflush(stdout);
 
-  while ((option = getopt(argc, argv, ":hc:d:l:i:")) != -1) {
+  while ((option = getopt(argc, argv, ":hc:d:l:i:sw:")) != -1) {
     switch(option) {
       case 'h':
         print_usage(argv[0]);
@@ -372,6 +2046,12 @@ int main(int argc, char *argv[])
       case 'i':
 	tds_id = atoi(optarg);
 	break;
+      case 's':
+	supervisor = true;
+	break;
+      case 'w':
+	watchdog = atof(optarg);
+	break;
       case ':':
 	printf("Option %c needs a value\n", optopt);
 	exit(-1);
@@ -388,8 +2068,13 @@ int main(int argc, char *argv[])
   }
 
   FILE *fp_log = NULL;
-  if (logfile[0] != '\0')
+  static char log_buf[BUFSIZ];
+  if (logfile[0] != '\0') {
     fp_log = fopen(logfile, "a");
+    // Only written from the output stage; give it its buffer now rather than on the first write
+    if (fp_log != NULL)
+      setvbuf(fp_log, log_buf, _IOFBF, BUFSIZ);
+  }
 
   signal(SIGINT, sig_handler);
 
@@ -417,20 +2102,25 @@ int main(int argc, char *argv[])
     printf("ERROR: cannot parse JSON configuration file\n");
     exit(-1);
   }
+  double config_time = what_time_is_it_now() - launch_time;
 
 
   /*************************************************************************************/
-  /* Determine input's dimensions (width and height)                                   */
+  /* List input images                                                                 */
   /*************************************************************************************/
-  dim_t dimensions;
-  if (get_input_dimensions(conf_params, &dimensions) != 0) {
-    printf("ERROR: cannot determine input's dimensions (width and height)\n");
-    exit(-1);
+  // Images, like camera and video frames, may have any size: every frame carries its own
+  // dimensions, so there is nothing to probe up front
+  image_list_t images = {0};
+  if (conf_params.use_input_images) {
+    // Each image is decoded and letterboxed in-process
+    if (image_list_load(conf_params.input_images, &images) != 0)
+      exit(-1);
+    printf("Images:        %d (%s)\n", images.count, conf_params.input_images);
   }
 
 
   /*************************************************************************************/
-  /* Initialize Darknet model                                                          */
+  /* Initialize Darknet model (the weights are loaded while the inputs are opened)     */
   /*************************************************************************************/
   char datacfg[1024];
   char cfgfile[1024];
@@ -438,6 +2128,11 @@ int main(int argc, char *argv[])
   snprintf(datacfg,    1024, "%s/%s", conf_params.darknet_home, conf_params.darknet_datacfg);
   snprintf(cfgfile,    1024, "%s/%s", conf_params.darknet_home, conf_params.darknet_cfgfile);
   snprintf(weightfile, 1024, "%s/%s", conf_params.darknet_home, conf_params.darknet_weightfile);
+  char confirm_cfgfile[1024];
+  char confirm_weightfile[1024];
+  bool cascade = (conf_params.confirm_cfgfile[0] != '\0');
+  snprintf(confirm_cfgfile,    1024, "%s/%s", conf_params.darknet_home, conf_params.confirm_cfgfile);
+  snprintf(confirm_weightfile, 1024, "%s/%s", conf_params.darknet_home, conf_params.confirm_weightfile);
   float thresh       = .5;
   float hier_thresh  = .5;
 
@@ -448,210 +2143,350 @@ int main(int argc, char *argv[])
   printf("Data config:    %s\n", datacfg);
   printf("Model config:   %s\n", cfgfile);
   printf("Weights:        %s\n", weightfile);
+  if (cascade)
+    printf("Confirmed by:   %s, %s (candidates above %.2f)\n", confirm_cfgfile, confirm_weightfile,
+           conf_params.candidate_thresh);
+  printf("Cameras:        %d\n", conf_params.ncams);
+  printf("Batch size:     %d (max. wait %d ms)\n", conf_params.batch_size, conf_params.batch_wait_ms);
   printf("FFmpeg command: %s\n", FFMPEG_CMD);
+  convert_init();
+  printf("Conversion:     %s kernel\n", convert_kernel_name());
   printf("\n");
   fflush(stdout);
 
-  list *options = read_data_cfg(datacfg);
-  metadata meta = get_metadata(datacfg);
-  char *name_list = option_find_str(options, "names", "names.list");
-  char **names = get_labels(name_list);
+  // Same as load_network(cfgfile, weightfile, 0), split so that the input size of the network
+  // is known (for prescaling) before the weights are loaded
+  double cfg_start = what_time_is_it_now();
+  network *net = parse_network_cfg(cfgfile);
+  double cfg_time = what_time_is_it_now() - cfg_start;
+  model_t model = {.datacfg = datacfg, .cfgfile = cfgfile, .weightfile = weightfile,
+                   .cache_flags = (conf_params.weight_cache ? WEIGHT_CACHE_FILE : 0) |
+                                  (conf_params.shared_weights ? WEIGHT_CACHE_SHARED : 0),
+                   .net = net};
+  pthread_t model_thread;
+  if (pthread_create(&model_thread, NULL, load_model_thread, &model) != 0) {
+    printf("ERROR: cannot start loading the model\n");
+    exit(-1);
+  }
+  // The confirming network of a cascade loads alongside; it shares the labels of the first one
+  model_t confirm = {.cfgfile = confirm_cfgfile, .weightfile = confirm_weightfile,
+                     .cache_flags = model.cache_flags};
+  pthread_t confirm_thread;
+  if (cascade) {
+    confirm.net = parse_network_cfg(confirm_cfgfile);
+    if (confirm.net->layers[confirm.net->n-1].classes != net->layers[net->n-1].classes) {
+      printf("ERROR: the networks of the cascade detect different classes\n");
+      exit(-1);
+    }
+    if (pthread_create(&confirm_thread, NULL, load_model_thread, &confirm) != 0) {
+      printf("ERROR: cannot start loading the confirming model\n");
+      exit(-1);
+    }
+  }
 
-  image **alphabet = load_alphabet();
-  network *net = load_network(cfgfile, weightfile, 0);
-  set_batch_network(net, 1);
-  srand(2222222);
-  double curr_time;
-  float nms=.45;
 
-#ifdef NNPACK
-  nnp_initialize();
-  net->threadpool = pthreadpool_create(4);
-#endif
+  /*************************************************************************************/
+  /* Supervisor mode: run the pipeline in forked workers that inherit the loaded model */
+  /*************************************************************************************/
+  bool model_loaded = false;
+  if (supervisor) {
+    pthread_join(model_thread, NULL);
+    if (cascade)
+      pthread_join(confirm_thread, NULL);
+    model_loaded = true;
+    char basedir[256];
+    strcpy(basedir, dirname);
+    int status = supervise(basedir, watchdog, dirname, sizeof(dirname), &tds_id);
+    if (status != 0)
+      exit(status < 0 ? -1 : 0);
+    // In the worker, startup is timed from the fork
+    launch_time = what_time_is_it_now();
+    config_time = cfg_time = model.load_time = 0;
+    printf("Worker %u (pid %d), model inherited from the supervisor (pid %d)\n", tds_id, getpid(), getppid());
+  }
 
 
   /*************************************************************************************/
   /* Create pipe to read from video/image source                                       */
   /*************************************************************************************/
+  double inputs_start = what_time_is_it_now();
+  // In prescale mode the decoder delivers frames already scaled to fit the network input
+  dim_t fit = {0, 0, 3};
+  char filter[256] = "";
+  double frame_step = 0;
+  if (conf_params.use_input_video) {
+    // Offline video: ffmpeg drops the frames in between, and each kept frame is frame_step
+    // seconds of media time after the previous one
+    if (conf_params.frame_interval > 0) {
+      snprintf(filter, sizeof(filter), FFMPEG_INTERVAL_FILTER, conf_params.frame_interval);
+      frame_step = conf_params.frame_interval;
+    }
+    else {
+      double fps = get_video_frame_rate(conf_params.input_video);
+      if (fps <= 0) {
+        printf("ERROR: Cannot get the frame rate of %s\n", conf_params.input_video);
+        return -1;
+      }
+      if (conf_params.frame_stride > 1)
+        snprintf(filter, sizeof(filter), FFMPEG_STRIDE_FILTER, conf_params.frame_stride);
+      frame_step = conf_params.frame_stride/fps;
+    }
+    printf("Video:          %s, one frame every %.3f sec\n", conf_params.input_video, frame_step);
+  }
+  if (conf_params.prescale && !conf_params.use_input_images) {
+    fit.width  = net->w;
+    fit.height = net->h;
+    size_t len = strlen(filter);
+    snprintf(filter + len, sizeof(filter) - len, len > 0 ? "," FFMPEG_PRESCALE_FILTER : FFMPEG_PRESCALE_FILTER,
+             net->w, net->h);
+    printf("Prescale:       fit in %dx%d (%s)\n", net->w, net->h, filter);
+  }
+
   input_t input;
-  if (open_input_pipes(conf_params, &input) != 0){
+  if (open_input_pipes(conf_params, &input, fit, filter) != 0){
     printf("ERROR: cannot open input pipe(s)\n");
     exit(-1);
   }
+  double inputs_time = what_time_is_it_now() - inputs_start;
 
-  unsigned char *data = malloc(sizeof(unsigned char)*dimensions.width*dimensions.height*dimensions.c);
-  unsigned long count = 0, n = 0;
+  // The ffmpeg cameras are connecting meanwhile; their first frames wait in the pipes
+  if (!model_loaded) {
+    pthread_join(model_thread, NULL);
+    if (cascade)
+      pthread_join(confirm_thread, NULL);
+  }
+  double model_wait = what_time_is_it_now() - inputs_start - inputs_time;
+  metadata meta    = model.meta;
+  char **names     = model.names;
+  image **alphabet = model.alphabet;
+  // Each frame of a batch may go through the network as several crops (motion regions or tiles)
+  int max_crops = 0, c;
+  for (c = 0; conf_params.use_input_stream && c < conf_params.ncams; c++) {
+    cam_conf_t *cam = &conf_params.cameras[c];
+    if (cam->motion_crops + cam->tile_cols*cam->tile_rows > max_crops)
+      max_crops = cam->motion_crops + cam->tile_cols*cam->tile_rows;
+  }
+  int max_inputs = conf_params.batch_size*(max_crops > 0 ? max_crops : 1);
+  set_batch_network(net, max_inputs);
+  if (max_inputs > 1)
+    // Layer buffers are sized after the batch in the cfg file; resizing reallocates them for our batch
+    resize_network(net, net->w, net->h);
+  int max_boxes = network_max_boxes(net);
+  if (cascade) {
+    // The confirming network takes the inputs prepared for the first one, at its size
+    set_batch_network(confirm.net, max_inputs);
+    resize_network(confirm.net, net->w, net->h);
+    set_batch_network(confirm.net, 1);
+    if (network_max_boxes(confirm.net) > max_boxes)
+      max_boxes = network_max_boxes(confirm.net);
+  }
+  srand(2222222);
+  float nms=.45;
 
-  // Some statistics
-  double read_time       = 0;
-  double conversion_time = 0;
-  double prediction_time = 0;
-  double boxing_time     = 0;
+#ifdef NNPACK
+  nnp_initialize();
+  net->threadpool = pthreadpool_create(4);
+  if (cascade)
+    confirm.net->threadpool = net->threadpool;
+#endif
 
-  FILE *pipein;
-  int cam_id;
-  char outfile[300];
-  time_t timestamp;
-  bool object_detected;
-  int read_attempt = 0;
-  short sequence[CAMS][CATEGS];
-  char sequence_str[3000];
-  bool first_time = true;
+  pipeline_t *p = calloc(1, sizeof(pipeline_t));
+  p->conf        = &conf_params;
+  p->input       = &input;
+  p->net         = net;
+  p->meta        = meta;
+  p->names       = names;
+  p->alphabet    = alphabet;
+  p->thresh      = thresh;
+  p->hier_thresh = hier_thresh;
+  p->nms         = nms;
+  p->fp_log      = fp_log;
+  p->images      = images;
+  p->frame_step  = frame_step;
+  p->launch_time = launch_time;
+  p->max_inputs  = max_inputs;
+  p->max_boxes   = max_boxes;
+  p->confirm_net = confirm.net;
+  p->candidate_thresh = conf_params.candidate_thresh;
+  p->confirm_slot     = malloc(sizeof(int)*max_inputs);
+
+  // Per-camera logging state is sized after the number of configured cameras
+  p->sequence     = malloc(sizeof(*p->sequence)*input.ncams);
+  p->seen         = calloc(input.ncams, sizeof(bool));
+  p->sequence_str = malloc(input.ncams*(CATEGS*4+16) + 64);
+  int cam, categ, i;
+  for (cam=0; cam<input.ncams; cam++)
+    for (categ=0; categ<CATEGS; categ++)
+      p->sequence[cam][categ] = -1;
 
   chdir(dirname);
-  FILE *fp_pred = fopen("predictions.log", "w");
-  fprintf(fp_pred, "cam_id,time,object_id,object_name,prob,read_time_sec,conv_time_sec,pred_time_sec,bbox_time_sec\n");
-
-  do {
-
-    /*************************************************************************************/
-    /* Show signs of life                                                                */
-    /*************************************************************************************/
-    if(access("alive", F_OK ) == 0)
-      // File 'alive' exists; delete it
-      remove("alive");
-
-
-    /*************************************************************************************/
-    /* Capture image to process                                                          */
-    /*************************************************************************************/
-    cam_id = (n % CAMS) + 1;
-
-    if (cam_id == 1) {
-      // We start a new camera "sequence" (cam1, cam2, cam3, cam4, cam5, cam6). We keep all
-      // the classification results for a given sequence together for logging convenience
-
-      // First dump the previous sequence to the global logfile (if specified) in JSON format
-      if (fp_log != NULL && !first_time) {
-        to_json_string(sequence, sequence_str);
-        fprintf(fp_log, "%s\n", sequence_str);
-        fflush(fp_log);
-      }
-      // We start the new sequence
-      int cam, categ;
-      for (cam=0; cam<CAMS; cam++)
-	for (categ=0; categ<CATEGS; categ++)
-	  sequence[cam][categ] = -1;
-      first_time = false;
+  p->fp_pred = fopen("predictions.log", "w");
+  fprintf(p->fp_pred, "%s,%s,", conf_params.use_input_images ? "image" : "cam_id", conf_params.use_input_video ? "media_time" : "time");
+  fprintf(p->fp_pred, "object_id,object_name,prob,read_time_sec,conv_time_sec,pred_time_sec,bbox_time_sec,frame_age_sec\n");
+  for (cam=0; cam<input.ncams; cam++)
+    if (input.cams[cam].track_interval > 0) {
+      p->fp_events = fopen("events.log", "w");
+      fprintf(p->fp_events, "cam_id,time,event,track_id,object_id,object_name,prob,x,y,w,h,duration_sec\n");
+      break;
     }
 
-    pipein = get_pipe(cam_id, input); n++;
-    if (pipein == NULL) continue;
-    printf("Reading from pipe %d (%p)\n", cam_id, (void *)pipein); fflush(stdout);
-    curr_time = what_time_is_it_now();
-    size_t size = fread(data, 1, dimensions.width*dimensions.height*dimensions.c, pipein);
-    read_attempt++;
-    //printf("Read %d\n", size); fflush(stdout);
-    read_time = (what_time_is_it_now()-curr_time);
-    if (size == 0 || size != dimensions.width*dimensions.height*dimensions.c) {
-      printf("Warning: %zu bytes read (expected: %d)!\n", size, dimensions.width*dimensions.height*dimensions.c); fflush(stdout);
-      if (read_attempt == 30) {
-        printf("Tried 30 reading attempts. Now quitting.\n"); fflush(stdout);
-        exit_loop = true;
-      }
-      sleep(1);
+
+  /*************************************************************************************/
+  /* Start pipeline stages (readers -> preprocess -> inference -> output)              */
+  /*************************************************************************************/
+  // The ingest queue holds a frame of every camera, so the scheduler can choose among all of them
+  if (queue_init_ordered(&p->ingest_q, input.ncams > QUEUE_DEPTH ? input.ncams : QUEUE_DEPTH, frame_before) != 0 ||
+      queue_init(&p->infer_q, QUEUE_DEPTH) != 0 ||
+      queue_init(&p->output_q, QUEUE_DEPTH) != 0) {
+    printf("ERROR: cannot create pipeline queues\n");
+    exit(-1);
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->reader_done, NULL);
+
+  // Frame buffers are allocated up front, except the raw data, which is sized by the first frame;
+  // the stages only recycle them
+  for (cam=0; cam<input.ncams; cam++) {
+    if (conf_params.use_input_images) {
+      // Decoders hold a frame each while decoding; the rest are decoded images waiting for inference
+      if (pool_init(&input.cams[cam].pool, conf_params.decode_threads + POOL_FRAMES, net, max_boxes, 0, 0) != 0)
+        exit(-1);
       continue;
     }
-    read_attempt = 0;
-
-    // Convert raw image into YOLO/Darknet image format
-    curr_time = what_time_is_it_now();
-    int i,j,k;
-    image im = make_image(dimensions.width, dimensions.height, dimensions.c);
-    for (k = 0; k < dimensions.c; ++k) {
-        for (j = 0; j < dimensions.height; ++j) {
-  	  for (i = 0; i < dimensions.width; ++i) {
-  	      int dst_index = i + dimensions.width*j + dimensions.width*dimensions.height*k;
-  	      int src_index = k + dimensions.c*i + dimensions.c*dimensions.width*j;
-  	      im.data[dst_index] = (float)data[src_index]/255.;
-  	  }
-        }
+    if (!camera_is_open(&input.cams[cam]) && !uses_ingest_thread(&input.cams[cam])) continue;
+    if (pool_init(&input.cams[cam].pool, POOL_FRAMES, net, max_boxes, input.cams[cam].max_crops,
+                  input.cams[cam].track_interval > 0 ? TRACK_MAX_EVENTS : 0) != 0)
+      exit(-1);
+    if (input.cams[cam].track_interval > 0)
+      // Static frames of a tracked camera get its tracks rather than its last detections
+      tracker_init(&input.cams[cam].tracker);
+    if (input.cams[cam].motion_threshold > 0) {
+      motion_init(&input.cams[cam].motion);
+      if (input.cams[cam].track_interval == 0 &&
+          (input.cams[cam].last_dets = make_detections(net, input.cams[cam].pool.frames[0].max_boxes)) == NULL) {
+        printf("ERROR: cannot allocate detections for camera %d\n", cam+1);
+        exit(-1);
+      }
     }
-    image sized     = letterbox_image(im, net->w, net->h);
-    float *X        = sized.data;
-    conversion_time = (what_time_is_it_now()-curr_time);
-    //printf("Image converted in %f seconds.\n", what_time_is_it_now()-curr_time);
-
-
-    /*************************************************************************************/
-    /* Detect objects                                                                    */
-    /*************************************************************************************/
-    curr_time = what_time_is_it_now();
-    network_predict(net, X);
-    //printf("Predicted in %f seconds.\n", what_time_is_it_now()-curr_time);
-    prediction_time = (what_time_is_it_now()-curr_time);
-    int nboxes = 0;
-    curr_time = what_time_is_it_now();
-    detection *dets = get_network_boxes(net, im.w, im.h, thresh, hier_thresh, 0, 1, &nboxes);
-    if (nms) do_nms_sort(dets, nboxes, meta.classes, nms);
-    draw_detections(im, dets, nboxes, thresh, names, alphabet, meta.classes);
-    boxing_time = (what_time_is_it_now()-curr_time);
-    //printf("Boxes generated in %f seconds.\n", what_time_is_it_now()-curr_time);
-
+  }
 
-    /*************************************************************************************/
-    /* Write log and images                                                              */
-    /*************************************************************************************/
-    time(&timestamp);
-    object_detected = false;
-    for(i = 0; i < nboxes; ++i){
-      for(j = 0; j < meta.classes; ++j) {
-	if (dets[i].prob[j]) {
-          // Logging to text file
-	  fprintf(fp_pred, "%d,%ld,%d,%s,%.4f,%.4f,%.4f,%.4f,%.4f\n",
-                                          cam_id,
-                                          timestamp,
-                                          coco_ids[j],
-					  names[j],
-					  dets[i].prob[j],
-					  read_time,
-					  conversion_time,
-					  prediction_time,
-					  boxing_time
-					  );
-	  sequence[cam_id-1][j] = 1;
-	  object_detected = true;
-	}
-      }
+  double start_time = what_time_is_it_now();
+  printf("\nStartup:        %.3f sec (config %.3f, model config %.3f, weights and labels %.3f in parallel with\n"
+         "                opening the inputs %.3f, then waiting %.3f for the model, pipeline setup %.3f)\n\n",
+         start_time - launch_time, config_time, cfg_time, model.load_time, inputs_time, model_wait,
+         start_time - inputs_start - inputs_time - model_wait);
+  fflush(stdout);
+  pthread_create(&p->output_thread, NULL, output_thread, p);
+  pthread_create(&p->infer_thread, NULL, infer_thread, p);
+  pthread_create(&p->preprocess_thread, NULL, preprocess_thread, p);
+  bool ingest = false;
+  for (cam=0; cam<input.ncams; cam++) {
+    camera_t *camera = &input.cams[cam];
+    camera->pipeline = p;
+    if (uses_ingest_thread(camera)) {
+      // Including a camera whose ffmpeg could not be started; the ingest thread retries it
+      camera->running = true;
+      ingest = true;
+      continue;
     }
-    
-    if (object_detected) {
-      // We just log images where objects were detected
-      snprintf(outfile, 270, "cam_%d_frame_%05ld", cam_id, count);
-      save_image(im, outfile);
+    if (!camera_is_open(camera)) continue;
+    camera->running = true;
+    p->active_readers++;
+    pthread_create(&camera->thread, NULL, reader_thread, camera);
+  }
+  if (ingest) {
+    p->active_readers++;
+    pthread_create(&p->ingest_thread, NULL, ingest_thread, p);
+  }
+  if (conf_params.use_input_images) {
+    p->ndecoders = conf_params.decode_threads;
+    p->decoders  = malloc(sizeof(pthread_t)*p->ndecoders);
+    for (i=0; i<p->ndecoders; i++) {
+      p->active_readers++;
+      pthread_create(&p->decoders[i], NULL, image_decoder_thread, p);
     }
+  }
 
+  // Wait until all readers are done (end of input) or we are asked to quit
+  pthread_mutex_lock(&p->lock);
+  while (p->active_readers > 0 && !exit_loop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&p->reader_done, &p->lock, &deadline);
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  // The ingest thread never blocks for long and sees exit_loop by itself
+  if (ingest)
+    pthread_join(p->ingest_thread, NULL);
+  for (cam=0; cam<input.ncams; cam++) {
+    camera_t *camera = &input.cams[cam];
+    if (!camera_is_open(camera) || uses_ingest_thread(camera)) continue;
+    // Readers may still be blocked waiting for data from a live camera
+    if (camera->av != NULL)
+      libav_interrupt(camera->av);
+    else
+      pthread_cancel(camera->thread);
+    pthread_join(camera->thread, NULL);
+  }
+  for (i=0; i<p->ndecoders; i++)
+    pthread_join(p->decoders[i], NULL);
 
-    /*************************************************************************************/
-    /* Free and release stuff                                                            */
-    /*************************************************************************************/
-    free_detections(dets, nboxes);
-    free_image(im);
-    free_image(sized);
-
-
-    fflush(stdout);
-    fflush(stderr);
-    fflush(fp_pred);
-
-    count++;
-    sleep(5);
-
-  } while (!exit_loop);
+  // Let the remaining stages drain the frames already in flight
+  queue_close(&p->ingest_q);
+  pthread_join(p->preprocess_thread, NULL);
+  pthread_join(p->infer_thread, NULL);
+  pthread_join(p->output_thread, NULL);
 
 
-  // Flush and close input and output pipes
+  // Flush and close input and output pipes (decoder CPU times are known once they are closed)
+  double elapsed = what_time_is_it_now() - start_time;
   close_input_pipes(input);
-  free(data);
+  print_camera_stats(input, elapsed, cascade);
+  if (conf_params.use_input_images || conf_params.use_input_video)
+    printf("Processed %lu %s in %.2f sec (%.2f per sec)\n", p->count, conf_params.use_input_images ? "images" : "frames",
+           elapsed, elapsed > 0 ? p->count/elapsed : 0.);
+  print_memory_usage();
+#ifdef TDS_ALLOC_DEBUG
+  printf("Heap allocations in frame path: %lu\n", alloc_debug_count());
+#endif
+
+  for (cam=0; cam<input.ncams; cam++) {
+    if (input.cams[cam].last_dets != NULL)
+      free_detections(input.cams[cam].last_dets, input.cams[cam].pool.frames[0].max_boxes);
+    pool_destroy(&input.cams[cam].pool);
+  }
+  free(input.cams);
+  free_image(p->snapshot);
+  weight_cache_release(net, &model.cache);
   free_network(net);
-  fclose(fp_pred);
+  if (cascade) {
+    weight_cache_release(confirm.net, &confirm.cache);
+    free_network(confirm.net);
+  }
+  fclose(p->fp_pred);
+  if (p->fp_events != NULL)
+    fclose(p->fp_events);
 
   if (fp_log != NULL) {
-    to_json_string(sequence, sequence_str);
-    fprintf(fp_log, "%s\n", sequence_str);
+    to_json_string(p->sequence, input.ncams, p->sequence_str);
+    fprintf(fp_log, "%s\n", p->sequence_str);
+    fflush(fp_log);
+    fclose(fp_log);
   }
-  fflush(fp_log);
-  fclose(fp_log);
+
+  queue_destroy(&p->ingest_q);
+  queue_destroy(&p->infer_q);
+  queue_destroy(&p->output_q);
+  free(p->sequence);
+  free(p->seen);
+  free(p->sequence_str);
+  free(p->decoders);
+  free(p->confirm_slot);
+  image_list_free(&p->images);
+  free(p);
+  free(conf_params.cameras);
 
 
 #ifdef NNPACK
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "tds-motion.h"
+
+#define MOTION_SAMPLES 8  // Pixels sampled per cell in each direction
+
+
+void motion_init(motion_t *m)
+{
+  memset(m, 0, sizeof(*m));
+}
+
+
+// Sampled pixels are spread evenly over the cell; small frames sample some pixels twice
+static unsigned char cell_luma(const unsigned char *rgb, int width, int x0, int x1, int y0, int y1)
+{
+  unsigned int sum = 0;
+  int i, j;
+  for (i = 0; i < MOTION_SAMPLES; i++) {
+    const unsigned char *row = rgb + 3*(size_t)width*(y0 + (y1-y0)*(2*i+1)/(2*MOTION_SAMPLES));
+    for (j = 0; j < MOTION_SAMPLES; j++) {
+      const unsigned char *px = row + 3*(x0 + (x1-x0)*(2*j+1)/(2*MOTION_SAMPLES));
+      // BT.601 luma in fixed point
+      sum += (77*px[0] + 150*px[1] + 29*px[2]) >> 8;
+    }
+  }
+  return sum / (MOTION_SAMPLES*MOTION_SAMPLES);
+}
+
+
+float motion_measure(motion_t *m, const unsigned char *rgb, int width, int height)
+{
+  unsigned char *cur = m->luma[1 - m->ref];
+  unsigned char *ref = m->luma[m->ref];
+  bool compare = (width == m->width && height == m->height);
+  int r, c, changed = 0;
+
+  for (r = 0; r < MOTION_ROWS; r++) {
+    int y0 = r*height/MOTION_ROWS, y1 = (r+1)*height/MOTION_ROWS;
+    for (c = 0; c < MOTION_COLS; c++) {
+      int i = r*MOTION_COLS + c;
+      cur[i] = cell_luma(rgb, width, c*width/MOTION_COLS, (c+1)*width/MOTION_COLS, y0, y1);
+      m->changed[i] = !compare || abs(cur[i] - ref[i]) > MOTION_DELTA;
+      changed += m->changed[i];
+    }
+  }
+  return (float)changed / (MOTION_ROWS*MOTION_COLS);
+}
+
+
+// Grid cells are grouped as their bounding rectangle (inclusive cell indices)
+typedef struct {
+  int c0, r0, c1, r1;
+} cells_t;
+
+
+static bool cells_overlap(cells_t *a, cells_t *b)
+{
+  return a->c0 <= b->c1 && b->c0 <= a->c1 && a->r0 <= b->r1 && b->r0 <= a->r1;
+}
+
+
+int motion_regions(motion_t *m, int width, int height, region_t *regions, int max)
+{
+  bool grown[MOTION_ROWS*MOTION_COLS] = {false};
+  short stack[MOTION_ROWS*MOTION_COLS];
+  cells_t groups[MOTION_ROWS*MOTION_COLS/4];
+  int ngroups = 0;
+  int r, c, i, j;
+
+  // Changed cells grown by one cell in every direction, so that nearby changes touch
+  for (r = 0; r < MOTION_ROWS; r++)
+    for (c = 0; c < MOTION_COLS; c++)
+      if (m->changed[r*MOTION_COLS + c]) {
+        int dr, dc;
+        for (dr = -1; dr <= 1; dr++)
+          for (dc = -1; dc <= 1; dc++)
+            if (r+dr >= 0 && r+dr < MOTION_ROWS && c+dc >= 0 && c+dc < MOTION_COLS)
+              grown[(r+dr)*MOTION_COLS + c+dc] = true;
+      }
+
+  // Connected groups of grown cells (flood fill, clearing the cells it visits)
+  for (i = 0; i < MOTION_ROWS*MOTION_COLS; i++) {
+    if (!grown[i])
+      continue;
+    if (ngroups == max)
+      return -1;
+    cells_t *g = &groups[ngroups++];
+    *g = (cells_t){i % MOTION_COLS, i / MOTION_COLS, i % MOTION_COLS, i / MOTION_COLS};
+    int top = 0;
+    stack[top++] = i;
+    grown[i] = false;
+    while (top > 0) {
+      int cell = stack[--top];
+      r = cell / MOTION_COLS;
+      c = cell % MOTION_COLS;
+      if (c < g->c0) g->c0 = c;
+      if (c > g->c1) g->c1 = c;
+      if (r < g->r0) g->r0 = r;
+      if (r > g->r1) g->r1 = r;
+      int next[4] = {cell - MOTION_COLS, cell + MOTION_COLS, (c > 0) ? cell-1 : -1, (c < MOTION_COLS-1) ? cell+1 : -1};
+      for (j = 0; j < 4; j++)
+        if (next[j] >= 0 && next[j] < MOTION_ROWS*MOTION_COLS && grown[next[j]]) {
+          grown[next[j]] = false;
+          stack[top++] = next[j];
+        }
+    }
+  }
+
+  // The boxes of groups that are not connected may still overlap
+  for (i = 0; i < ngroups; i++)
+    for (j = i+1; j < ngroups; j++)
+      if (cells_overlap(&groups[i], &groups[j])) {
+        if (groups[j].c0 < groups[i].c0) groups[i].c0 = groups[j].c0;
+        if (groups[j].r0 < groups[i].r0) groups[i].r0 = groups[j].r0;
+        if (groups[j].c1 > groups[i].c1) groups[i].c1 = groups[j].c1;
+        if (groups[j].r1 > groups[i].r1) groups[i].r1 = groups[j].r1;
+        groups[j] = groups[--ngroups];
+        // The grown box may now overlap boxes already checked
+        j = i;
+      }
+
+  for (i = 0; i < ngroups; i++) {
+    regions[i].x = groups[i].c0*width/MOTION_COLS;
+    regions[i].y = groups[i].r0*height/MOTION_ROWS;
+    regions[i].w = (groups[i].c1+1)*width/MOTION_COLS - regions[i].x;
+    regions[i].h = (groups[i].r1+1)*height/MOTION_ROWS - regions[i].y;
+  }
+  return ngroups;
+}
+
+
+void motion_accept(motion_t *m, int width, int height)
+{
+  m->ref    = 1 - m->ref;
+  m->width  = width;
+  m->height = height;
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_MOTION_H
+#define TDS_MOTION_H
+
+#include <stdbool.h>
+#include "tds.h"
+
+// Cheap change detection on a camera's frames. Each frame is reduced to a small grid of luma
+// cells (the average brightness of a few pixels sampled in each cell), which is compared with
+// the grid of the camera's reference frame: the last one that went to inference. Comparing with
+// the reference rather than the previous frame also catches slow changes, which add up until
+// they are noticed. The grids are part of the struct, so there is no allocation per frame.
+#define MOTION_COLS  64
+#define MOTION_ROWS  48
+#define MOTION_DELTA 16  // Luma levels a cell must change by (out of 255) to count as changed
+
+typedef struct {
+  unsigned char luma[2][MOTION_ROWS*MOTION_COLS];  // Grids of the reference and the latest frame
+  bool changed[MOTION_ROWS*MOTION_COLS];           // Cells of the latest frame that changed
+  int ref;                // Index of the reference grid
+  int width;              // Size of the reference frame (0: none yet)
+  int height;
+} motion_t;
+
+void  motion_init(motion_t *m);
+// Computes the grid of an rgb24 frame, and returns the fraction of its cells that changed since
+// the reference frame (all of them if there is no reference, or the frame size changed)
+float motion_measure(motion_t *m, const unsigned char *rgb, int width, int height);
+// Makes the frame last measured the reference
+void  motion_accept(motion_t *m, int width, int height);
+// Bounding boxes, in pixels of the width x height frame last measured, of the groups of its
+// changed cells. Cells less than two cells apart are grouped, and boxes that overlap are
+// merged. Returns the number of regions, or -1 if there are more than max
+int   motion_regions(motion_t *m, int width, int height, region_t *regions, int max);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tds-pool.h"
+
+
+static bool is_detection_layer(layer *l)
+{
+  return l->type == YOLO || l->type == REGION || l->type == DETECTION;
+}
+
+
+// Upper bound of the boxes get_network_boxes() can return (one per anchor and grid cell)
+int network_max_boxes(network *net)
+{
+  int i, max_boxes = 0;
+  for (i = 0; i < net->n; ++i)
+    if (is_detection_layer(&net->layers[i]))
+      max_boxes += net->layers[i].w*net->layers[i].h*net->layers[i].n;
+  return max_boxes;
+}
+
+
+// Number of class probabilities and mask coefficients of each detection
+static void detection_sizes(network *net, int *classes, int *masks)
+{
+  int i;
+  *classes = *masks = 0;
+  for (i = 0; i < net->n; ++i) {
+    layer *l = &net->layers[i];
+    if (!is_detection_layer(l)) continue;
+    if (l->classes > *classes) *classes = l->classes;
+    if (l->coords - 4 > *masks) *masks = l->coords - 4;
+  }
+}
+
+
+detection *make_detections(network *net, int max_boxes)
+{
+  int i, classes, masks;
+  detection_sizes(net, &classes, &masks);
+
+  detection *dets = calloc(max_boxes, sizeof(detection));
+  if (dets == NULL)
+    return NULL;
+  for (i = 0; i < max_boxes; ++i) {
+    dets[i].prob = calloc(classes, sizeof(float));
+    if (masks > 0)
+      dets[i].mask = calloc(masks, sizeof(float));
+    if (dets[i].prob == NULL || (masks > 0 && dets[i].mask == NULL)) {
+      free_detections(dets, max_boxes);
+      return NULL;
+    }
+  }
+  return dets;
+}
+
+
+// Copies the boxes into detections allocated by make_detections(), keeping their buffers
+void copy_detections(network *net, detection *dst, const detection *src, int nboxes)
+{
+  int i, classes, masks;
+  detection_sizes(net, &classes, &masks);
+  for (i = 0; i < nboxes; ++i) {
+    float *prob = dst[i].prob, *mask = dst[i].mask;
+    dst[i] = src[i];
+    dst[i].prob = memcpy(prob, src[i].prob, sizeof(float)*classes);
+    dst[i].mask = (masks > 0) ? memcpy(mask, src[i].mask, sizeof(float)*masks) : NULL;
+  }
+}
+
+
+int pool_init(frame_pool_t *pool, int nframes, network *net, int max_boxes, int max_crops, int max_events)
+{
+  int i, k;
+
+  pool->nframes = nframes;
+  pool->frames  = calloc(nframes, sizeof(frame_t));
+  if (pool->frames == NULL || queue_init(&pool->free_q, nframes) != 0) {
+    printf("ERROR: cannot allocate a pool of %d frames\n", nframes);
+    return -1;
+  }
+
+  for (i = 0; i < nframes; i++) {
+    frame_t *frame   = &pool->frames[i];
+    frame->pool      = pool;
+    frame->sized     = make_image(net->w, net->h, net->c);
+    // The boxes of all the crops of a frame are merged in its detections
+    frame->max_boxes = max_boxes*(max_crops > 0 ? max_crops : 1);
+    frame->dets      = make_detections(net, frame->max_boxes);
+    if (frame->sized.data == NULL || frame->dets == NULL) {
+      printf("ERROR: cannot allocate frame buffers\n");
+      return -1;
+    }
+    if (max_crops > 0) {
+      frame->max_crops = max_crops;
+      frame->crops     = calloc(max_crops, sizeof(image));
+      frame->regions   = calloc(max_crops, sizeof(region_t));
+      if (frame->crops == NULL || frame->regions == NULL) {
+        printf("ERROR: cannot allocate frame buffers\n");
+        return -1;
+      }
+      for (k = 0; k < max_crops; k++)
+        if ((frame->crops[k] = make_image(net->w, net->h, net->c)).data == NULL) {
+          printf("ERROR: cannot allocate frame buffers\n");
+          return -1;
+        }
+    }
+    if (max_events > 0) {
+      frame->max_events = max_events;
+      if ((frame->events = calloc(max_events, sizeof(track_event_t))) == NULL) {
+        printf("ERROR: cannot allocate frame buffers\n");
+        return -1;
+      }
+    }
+    queue_push(&pool->free_q, frame);
+  }
+
+  return 0;
+}
+
+
+void pool_destroy(frame_pool_t *pool)
+{
+  int i, k;
+  if (pool->frames == NULL)
+    return;
+  for (i = 0; i < pool->nframes; i++) {
+    frame_t *frame = &pool->frames[i];
+    free(frame->data);
+    free_image(frame->sized);
+    for (k = 0; k < frame->max_crops; k++)
+      free_image(frame->crops[k]);
+    free(frame->crops);
+    free(frame->regions);
+    free(frame->events);
+    free(frame->im.data);
+    if (frame->dets != NULL)
+      free_detections(frame->dets, frame->max_boxes);
+  }
+  queue_destroy(&pool->free_q);
+  free(pool->frames);
+  pool->frames = NULL;
+}
+
+
+// Blocks until one of the camera's frames is no longer in flight
+frame_t *pool_get(frame_pool_t *pool)
+{
+  return queue_pop(&pool->free_q);
+}
+
+
+// Returns NULL instead of blocking when all the frames are in flight
+frame_t *pool_try_get(frame_pool_t *pool)
+{
+  return queue_try_pop(&pool->free_q);
+}
+
+
+int reserve_buffer(void **buf, size_t *capacity, size_t size)
+{
+  if (size <= *capacity)
+    return 0;
+  // Expected once per size; not counted as an allocation in the frame path
+  bool armed = alloc_debug_arm(false);
+  void *p = realloc(*buf, size);
+  alloc_debug_arm(armed);
+  if (p == NULL) {
+    printf("ERROR: cannot allocate a %zu-byte frame buffer\n", size);
+    return -1;
+  }
+  *buf      = p;
+  *capacity = size;
+  return 0;
+}
+
+
+int frame_reserve(frame_t *frame, size_t size)
+{
+  return reserve_buffer((void **)&frame->data, &frame->data_size, size);
+}
+
+
+void pool_put(void *arg)
+{
+  frame_t *frame = arg;
+  frame->nboxes  = 0;
+  frame->ncrops  = 0;
+  frame->carried = false;
+  frame->tracked = false;
+  frame->nevents = 0;
+  queue_push(&frame->pool->free_q, frame);
+}
+
+
+#ifdef TDS_ALLOC_DEBUG
+
+// glibc's allocator entry points; our definitions of malloc() and friends interpose on the
+// ones in libc (for libdarknet and libc itself too) and forward to these
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+// volatile: the compiler assumes the allocator does not read our variables, and would drop a
+// disarm that only surrounds an allocation made in this file
+static __thread volatile bool alloc_armed = false;
+static unsigned long alloc_count = 0;
+
+
+bool alloc_debug_arm(bool armed)
+{
+  bool was_armed = alloc_armed;
+  alloc_armed = armed;
+  return was_armed;
+}
+
+
+unsigned long alloc_debug_count(void)
+{
+  return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+
+void *malloc(size_t size)
+{
+  if (alloc_armed)
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+
+void *calloc(size_t nmemb, size_t size)
+{
+  if (alloc_armed)
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+  if (alloc_armed)
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_POOL_H
+#define TDS_POOL_H
+
+#include <stdbool.h>
+#include "tds.h"
+#include "tds-queue.h"
+
+// Per-camera pool of frames. The network input and detection buffers (with room for max_boxes
+// boxes of each network input, and for max_crops crops of each frame, for motion-ROI and tiled
+// cameras), and the max_events track events of tracked cameras, are allocated in pool_init(),
+// and the raw data buffers (and decoded images) with the first frame of each size (frames
+// describe their own dimensions). The pipeline then only moves frames between the pool and the
+// stage queues. Its own steady state does no heap allocation; left out are the allocations
+// inside libav (demuxing and decoding), inside stb_image (decoding image files), in Darknet
+// when drawing and saving snapshots, and reserve_buffer() growing a buffer for a larger frame.
+typedef struct frame_pool {
+  frame_t *frames;
+  int nframes;
+  queue_t free_q;         // Frames not in flight
+} frame_pool_t;
+
+int      pool_init(frame_pool_t *pool, int nframes, network *net, int max_boxes, int max_crops, int max_events);
+void     pool_destroy(frame_pool_t *pool);
+frame_t *pool_get(frame_pool_t *pool);
+frame_t *pool_try_get(frame_pool_t *pool);
+void     pool_put(void *frame);
+int      frame_reserve(frame_t *frame, size_t size);
+// Grows a buffer reused across frames to at least size bytes. Only a frame larger than any
+// before it (the first one, or a change of resolution) reallocates it
+int      reserve_buffer(void **buf, size_t *capacity, size_t size);
+int      network_max_boxes(network *net);
+// Detections with their class probabilities (and masks) allocated; NULL if any allocation fails
+detection *make_detections(network *net, int max_boxes);
+void     copy_detections(network *net, detection *dst, const detection *src, int nboxes);
+
+// Debug accounting of heap allocations (build with -DTDS_ALLOC_DEBUG; needs a dynamically
+// linked glibc). Threads arm the counter around their per-frame work; any allocation made
+// by an armed thread, including inside libdarknet and libc, is counted. Arming returns the
+// previous state.
+#ifdef TDS_ALLOC_DEBUG
+bool          alloc_debug_arm(bool armed);
+unsigned long alloc_debug_count(void);
+#else
+static inline bool alloc_debug_arm(bool armed) { return false; }
+#define alloc_debug_count() 0UL
+#endif
+
+#endif
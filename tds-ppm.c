@@ -0,0 +1,70 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <ctype.h>
+#include "tds-ppm.h"
+
+
+void ppm_header_reset(ppm_header_t *h)
+{
+  h->len    = 0;
+  h->tokens = 0;
+}
+
+
+// Drops the bytes gathered so far; c may start the next header
+static void resync(ppm_header_t *h, unsigned char c)
+{
+  h->skipped += h->len;
+  ppm_header_reset(h);
+  if (c == 'P')
+    h->buf[h->len++] = c;
+  else
+    h->skipped++;
+}
+
+
+bool ppm_header_feed(ppm_header_t *h, unsigned char c, dim_t *dim)
+{
+  int width, height, maxval;
+
+  if ((h->len == 0 && c != 'P') || (h->len == 1 && c != '6') || (h->len == 2 && !isspace(c)) ||
+      h->len == PPM_HEADER_MAX-1) {
+    resync(h, c);
+    return false;
+  }
+  if (isspace(c) && !isspace((unsigned char)h->buf[h->len-1]))
+    h->tokens++;
+  h->buf[h->len++] = c;
+  // The single whitespace character after the maximum value ends the header
+  if (h->tokens < 4)
+    return false;
+
+  h->buf[h->len] = '\0';
+  if (sscanf(h->buf, "P6 %d %d %d", &width, &height, &maxval) != 3 || maxval != 255 ||
+      width <= 0 || height <= 0 || width > PPM_MAX_DIM || height > PPM_MAX_DIM) {
+    h->skipped += h->len;
+    ppm_header_reset(h);
+    return false;
+  }
+  ppm_header_reset(h);
+  dim->width  = width;
+  dim->height = height;
+  dim->c      = 3;
+  return true;
+}
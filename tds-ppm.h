@@ -0,0 +1,42 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_PPM_H
+#define TDS_PPM_H
+
+#include "tds.h"
+
+// Frames reach TDS as a stream of binary PPM images (ffmpeg's image2pipe muxer with the ppm
+// encoder): every frame is a "P6 <width> <height> 255" header followed by its rgb24 pixels. The
+// stream thus describes its own dimensions, which may change from one frame to the next, and a
+// reader that lost its place finds the next frame by looking for the next header.
+#define PPM_HEADER_MAX 32
+#define PPM_MAX_DIM    16384
+
+typedef struct {
+  char buf[PPM_HEADER_MAX];
+  int len;
+  int tokens;              // Whitespace-terminated tokens in buf
+  unsigned long skipped;   // Bytes dropped while looking for a header
+} ppm_header_t;
+
+void ppm_header_reset(ppm_header_t *h);
+// Feeds the next byte of the stream. Returns true when it completes a valid header, whose
+// dimensions are then in dim; the pixel data follows
+bool ppm_header_feed(ppm_header_t *h, unsigned char c, dim_t *dim);
+
+#endif
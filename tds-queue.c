@@ -0,0 +1,194 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "tds-queue.h"
+
+
+int queue_init(queue_t *q, int capacity)
+{
+  q->items = malloc(sizeof(void *)*capacity);
+  if (q->items == NULL) {
+    printf("ERROR: cannot allocate queue of %d entries\n", capacity);
+    return -1;
+  }
+  q->before   = NULL;
+  q->capacity = capacity;
+  q->head     = 0;
+  q->count    = 0;
+  q->closed   = false;
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+
+  return 0;
+}
+
+
+int queue_init_ordered(queue_t *q, int capacity, queue_before_fn before)
+{
+  if (queue_init(q, capacity) != 0)
+    return -1;
+  q->before = before;
+
+  return 0;
+}
+
+
+void queue_destroy(queue_t *q)
+{
+  pthread_cond_destroy(&q->not_full);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_mutex_destroy(&q->lock);
+  free(q->items);
+  q->items = NULL;
+}
+
+
+// Removes the next item; called with the lock held and the queue not empty. Ordered queues
+// are short (one slot per camera at most), so a linear scan finds the item to pop and moves
+// it to the head
+static void *queue_take(queue_t *q)
+{
+  int i, first = q->head;
+  struct timespec now;
+  void *item;
+
+  if (q->before != NULL) {
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (i = 1; i < q->count; i++) {
+      int k = (q->head + i) % q->capacity;
+      if (q->before(q->items[k], q->items[first], now.tv_sec + now.tv_nsec/1e9))
+        first = k;
+    }
+  }
+  item = q->items[first];
+  q->items[first] = q->items[q->head];
+  q->head = (q->head + 1) % q->capacity;
+  q->count--;
+  pthread_cond_signal(&q->not_full);
+
+  return item;
+}
+
+
+int queue_push(queue_t *q, void *item)
+{
+  pthread_mutex_lock(&q->lock);
+  while (q->count == q->capacity && !q->closed)
+    pthread_cond_wait(&q->not_full, &q->lock);
+  if (q->closed) {
+    pthread_mutex_unlock(&q->lock);
+    return -1;
+  }
+  q->items[(q->head + q->count) % q->capacity] = item;
+  q->count++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+
+  return 0;
+}
+
+
+void *queue_pop(queue_t *q)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed)
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  if (q->count > 0)
+    item = queue_take(q);
+  pthread_mutex_unlock(&q->lock);
+
+  return item;
+}
+
+
+// Like queue_pop(), but gives up at the given (CLOCK_REALTIME) deadline and returns NULL
+void *queue_pop_timed(queue_t *q, const struct timespec *deadline)
+{
+  void *item = NULL;
+  int rc = 0;
+
+  pthread_mutex_lock(&q->lock);
+  while (q->count == 0 && !q->closed && rc == 0)
+    rc = pthread_cond_timedwait(&q->not_empty, &q->lock, deadline);
+  if (q->count > 0)
+    item = queue_take(q);
+  pthread_mutex_unlock(&q->lock);
+
+  return item;
+}
+
+
+// Like queue_pop(), but returns NULL at once if the queue is empty
+void *queue_try_pop(queue_t *q)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0)
+    item = queue_take(q);
+  pthread_mutex_unlock(&q->lock);
+
+  return item;
+}
+
+
+// Index of the queued item that belongs to key, -1 if none; called with the lock held
+static int queue_find(queue_t *q, queue_match_fn match, const void *key)
+{
+  int i;
+  for (i = 0; i < q->count; i++) {
+    int k = (q->head + i) % q->capacity;
+    if (match(q->items[k], key))
+      return k;
+  }
+  return -1;
+}
+
+
+// Takes back the queued item that belongs to key without waiting (NULL if there is none)
+void *queue_remove(queue_t *q, queue_match_fn match, const void *key)
+{
+  void *item = NULL;
+  int k;
+
+  pthread_mutex_lock(&q->lock);
+  if ((k = queue_find(q, match, key)) >= 0) {
+    item = q->items[k];
+    q->items[k] = q->items[q->head];
+    q->head = (q->head + 1) % q->capacity;
+    q->count--;
+    pthread_cond_signal(&q->not_full);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return item;
+}
+
+
+void queue_close(queue_t *q)
+{
+  pthread_mutex_lock(&q->lock);
+  q->closed = true;
+  pthread_cond_broadcast(&q->not_empty);
+  pthread_cond_broadcast(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+}
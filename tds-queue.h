@@ -0,0 +1,59 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_QUEUE_H
+#define TDS_QUEUE_H
+
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+
+// Returns whether item a must be popped before item b at time now (seconds since the epoch, read
+// once per pop, so that an order that depends on time is the same for all the items compared)
+typedef bool (*queue_before_fn)(const void *a, const void *b, double now);
+// Returns whether an item belongs to key (e.g. a frame to its camera's pool)
+typedef bool (*queue_match_fn)(const void *item, const void *key);
+
+// Bounded, blocking FIFO of pointers used to hand frames between pipeline stages.
+// Producers block while the queue is full (backpressure) and consumers block while
+// it is empty. Once closed, pushes fail and pops return NULL after the queue drains.
+// An ordered queue pops the item that goes before all the others instead of the oldest one.
+typedef struct {
+  void **items;
+  queue_before_fn before; // NULL for FIFO order
+  int capacity;
+  int head;
+  int count;
+  bool closed;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} queue_t;
+
+int   queue_init(queue_t *q, int capacity);
+int   queue_init_ordered(queue_t *q, int capacity, queue_before_fn before);
+void  queue_destroy(queue_t *q);
+int   queue_push(queue_t *q, void *item);
+void *queue_pop(queue_t *q);
+void *queue_pop_timed(queue_t *q, const struct timespec *deadline);
+void *queue_try_pop(queue_t *q);
+// Takes back the queued item that belongs to key without waiting (NULL if there is none). The
+// FIFO order of the other items is not kept, so it is meant for ordered queues
+void *queue_remove(queue_t *q, queue_match_fn match, const void *key);
+void  queue_close(queue_t *q);
+
+#endif
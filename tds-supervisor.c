@@ -0,0 +1,285 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include "tds.h"
+#include "tds-supervisor.h"
+
+#define SUPERVISOR_POLL_MS 1000  // Longest wait for worker events before checking for SIGINT
+#define STOP_GRACE 10.0          // Seconds a worker has to exit after SIGINT
+#define RESPAWN_MIN 1.0          // Seconds before restarting a worker that failed before classifying
+#define RESPAWN_MAX 60.0         // a frame; doubles after every such failure, up to this
+
+typedef enum {WORKER_EXITED, WORKER_HUNG, WORKER_STOPPED} worker_end_t;
+
+typedef struct {
+  unsigned int id;
+  pid_t pid;
+  int pidfd;          // Becomes readable when the worker exits (-1 if the kernel lacks pidfd_open)
+  int heartbeat;      // Supervisor's end of the heartbeat socket
+  double started;     // Monotonic times
+  double first_beat;  // 0 until the worker classifies a frame
+  double last_beat;
+} worker_t;
+
+static int heartbeat_fd = -1;  // Worker's end of the heartbeat socket
+
+
+static double now(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec/1e9;
+}
+
+
+// Prints a supervisor message with a timestamp
+static void log_msg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void log_msg(const char *fmt, ...)
+{
+  char stamp[32];
+  time_t t = time(NULL);
+  va_list args;
+
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&t));
+  printf("[%s] ", stamp);
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+  fflush(stdout);
+}
+
+
+// Creates the run directory of a worker, named after the time (run_y<year>m<month>d<day>_...)
+static int make_run_dir(const char *basedir, unsigned int id, char *rundir, size_t len)
+{
+  char name[64];
+  time_t t = time(NULL);
+
+  strftime(name, sizeof(name), "run_y%Ym%md%d_h%Hm%Ms%S", localtime(&t));
+  snprintf(rundir, len, "%s/%s", basedir, name);
+  if (mkdir(rundir, 0755) == 0)
+    return 0;
+  // Restarts within the same second
+  snprintf(rundir, len, "%s/%s_%u", basedir, name, id);
+  if (mkdir(rundir, 0755) == 0 || errno == EEXIST)
+    return 0;
+  log_msg("ERROR: cannot create run directory %s", rundir);
+  return -1;
+}
+
+
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  (void)pid;
+  return -1;
+#endif
+}
+
+
+// Sleeps for the given seconds, or until SIGINT
+static void pause_for(double seconds)
+{
+  double until = now() + seconds, left;
+  while (!exit_loop && (left = until - now()) > 0)
+    poll(NULL, 0, (left*1000 < SUPERVISOR_POLL_MS) ? left*1000 + 1 : SUPERVISOR_POLL_MS);
+}
+
+
+// Asks a worker to exit, and kills it if it does not within STOP_GRACE seconds
+static void stop_worker(worker_t *w, int *status)
+{
+  double deadline = now() + STOP_GRACE;
+
+  kill(w->pid, SIGINT);
+  while (waitpid(w->pid, status, WNOHANG) == 0) {
+    if (now() > deadline) {
+      kill(w->pid, SIGKILL);
+      waitpid(w->pid, status, 0);
+      return;
+    }
+    poll(NULL, 0, 100);
+  }
+}
+
+
+// Waits for the worker to exit, or to go watchdog seconds without a heartbeat (since it started,
+// or since its last classified frame), or for SIGINT. Exits are noticed as soon as they happen:
+// the pidfd becomes readable and the heartbeat socket hangs up.
+static worker_end_t watch_worker(worker_t *w, double watchdog, double *outage, int *status)
+{
+  struct pollfd fds[2] = {{.fd = w->heartbeat, .events = POLLIN}, {.fd = w->pidfd, .events = POLLIN}};
+  nfds_t nfds = (w->pidfd >= 0) ? 2 : 1;
+  char beats[64];
+
+  while (!exit_loop) {
+    double left = ((w->last_beat > 0) ? w->last_beat : w->started) + watchdog - now();
+    if (left <= 0)
+      return WORKER_HUNG;
+    int timeout = (left*1000 < SUPERVISOR_POLL_MS) ? left*1000 + 1 : SUPERVISOR_POLL_MS;
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      log_msg("ERROR: cannot wait for worker %u (%s)", w->id, strerror(errno));
+      return WORKER_HUNG;
+    }
+
+    bool gone = (fds[0].revents & (POLLHUP | POLLERR)) || (nfds == 2 && fds[1].revents);
+    if (fds[0].revents & POLLIN) {
+      ssize_t n = recv(w->heartbeat, beats, sizeof(beats), MSG_DONTWAIT);
+      if (n == 0)
+        gone = true;
+      else if (n > 0) {
+        w->last_beat = now();
+        if (w->first_beat == 0) {
+          w->first_beat = w->last_beat;
+          if (*outage > 0) {
+            log_msg("Worker %u classified its first frame %.1f sec after it started; outage lasted %.1f sec",
+                    w->id, w->first_beat - w->started, w->first_beat - *outage);
+            *outage = 0;
+          }
+        }
+      }
+    }
+    if (gone) {
+      waitpid(w->pid, status, 0);
+      return WORKER_EXITED;
+    }
+  }
+  return WORKER_STOPPED;
+}
+
+
+void supervisor_heartbeat(void)
+{
+  static const char beat = 1;
+
+  // A full socket already tells the supervisor that the worker is alive; a supervisor that is
+  // gone must not kill the worker with SIGPIPE
+  if (heartbeat_fd >= 0)
+    send(heartbeat_fd, &beat, 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+
+int supervise(const char *basedir, double watchdog, char *rundir, size_t len, unsigned int *id)
+{
+  char out[1100];
+  double backoff = RESPAWN_MIN;
+  double outage = 0;  // Monotonic time the current outage started, 0 if none
+  int status, sv[2];
+
+  log_msg("Supervisor %d: model loaded; starting workers (watchdog %.0f sec)", getpid(), watchdog);
+  while (!exit_loop) {
+    if (make_run_dir(basedir, *id, rundir, len) != 0)
+      return -1;
+    snprintf(out, sizeof(out), "%s/tds.out", rundir);
+    // Close-on-exec, so that the worker's ffmpeg processes do not keep the socket open after the
+    // worker exits
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+      log_msg("ERROR: cannot create the heartbeat socket (%s)", strerror(errno));
+      return -1;
+    }
+
+    // Buffered output would otherwise be written by both processes
+    fflush(stdout);
+    fflush(stderr);
+    worker_t w = {.id = *id, .started = now(), .heartbeat = sv[0]};
+    w.pid = fork();
+    if (w.pid < 0) {
+      log_msg("ERROR: cannot fork a worker");
+      return -1;
+    }
+    if (w.pid == 0) {
+      // Workers do not outlive the supervisor
+      prctl(PR_SET_PDEATHSIG, SIGINT);
+      close(sv[0]);
+      heartbeat_fd = sv[1];
+      if (freopen(out, "w", stdout) == NULL)
+        _exit(1);
+      dup2(fileno(stdout), STDERR_FILENO);
+      return 0;
+    }
+    close(sv[1]);
+    w.pidfd = open_pidfd(w.pid);
+    log_msg("Worker %u started (pid %d) in %s", w.id, w.pid, rundir);
+
+    worker_end_t end = watch_worker(&w, watchdog, &outage, &status);
+    close(w.heartbeat);
+    if (w.pidfd >= 0)
+      close(w.pidfd);
+
+    switch (end) {
+      case WORKER_STOPPED:
+        stop_worker(&w, &status);
+        log_msg("Worker %u stopped", w.id);
+        if (outage > 0)
+          log_msg("Outage of %.1f sec still ongoing", now() - outage);
+        return 1;
+      case WORKER_HUNG:
+        kill(w.pid, SIGKILL);
+        waitpid(w.pid, &status, 0);
+        log_msg("Worker %u did not classify a frame for %.0f sec (replacing it)", w.id, watchdog);
+        // The outage started with the last frame the worker classified
+        if (outage == 0)
+          outage = (w.last_beat > 0) ? w.last_beat : w.started;
+        break;
+      case WORKER_EXITED:
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+          log_msg("Worker %u completed", w.id);
+          return 1;
+        }
+        if (WIFSIGNALED(status))
+          log_msg("Worker %u was killed by signal %d after %.1f sec (replacing it)", w.id, WTERMSIG(status), now() - w.started);
+        else
+          log_msg("Worker %u exited with status %d after %.1f sec (replacing it)", w.id, WEXITSTATUS(status), now() - w.started);
+        if (outage == 0)
+          outage = now();
+        break;
+    }
+    (*id)++;
+
+    // A worker that classified frames is replaced right away; one that failed before (e.g. the
+    // cameras cannot be opened) is restarted with an exponential backoff, not in a tight loop
+    if (w.first_beat > 0)
+      backoff = RESPAWN_MIN;
+    else {
+      log_msg("Restarting in %.0f sec", backoff);
+      pause_for(backoff);
+      backoff = (2*backoff < RESPAWN_MAX) ? 2*backoff : RESPAWN_MAX;
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_SUPERVISOR_H
+#define TDS_SUPERVISOR_H
+
+#include <stddef.h>
+
+// Supervisor mode (-s). The process that loaded the model stays as a supervisor and forks
+// worker processes, which inherit the loaded network copy-on-write and run the pipeline. A
+// worker that exits with an error, or hangs, is replaced by a new fork without reading the
+// model again. The supervisor learns of a worker's exit as soon as it happens, and the worker
+// reports every classified frame over a heartbeat socket; a worker that goes watchdog seconds
+// without one is considered hung. Workers that fail before classifying a frame are restarted
+// with an exponential backoff, and the supervisor logs how long each outage lasted.
+//
+// Each worker gets its own run directory under basedir, named after the time, where its
+// output goes to tds.out; its id is the TDS instance id. Returns 0 in each worker, with its run
+// directory in rundir; in the supervisor, returns 1 once it is done (on SIGINT, or when a worker
+// completes its input), -1 on error.
+int supervise(const char *basedir, double watchdog, char *rundir, size_t len, unsigned int *id);
+
+// Tells the supervisor that the worker classified a frame (does nothing outside supervisor mode)
+void supervisor_heartbeat(void);
+
+#endif
@@ -0,0 +1,165 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <math.h>
+#include <string.h>
+#include "tds-track.h"
+
+
+void tracker_init(tracker_t *t)
+{
+  memset(t, 0, sizeof(*t));
+  t->next_id = 1;
+}
+
+
+static box track_box(const track_t *track, double time)
+{
+  box b = track->bbox;
+  b.x += track->vx*(time - track->last_seen);
+  b.y += track->vy*(time - track->last_seen);
+  return b;
+}
+
+
+// How well a detection matches a track: its overlap, or for boxes that do not overlap enough, a
+// lower score as their centres are closer. 0: no match
+static float match_score(box predicted, box detected)
+{
+  float iou = box_iou(predicted, detected);
+  if (iou >= TRACK_MIN_IOU)
+    return iou;
+  float limit = TRACK_MAX_SHIFT*fmaxf(predicted.w, predicted.h);
+  float dist  = hypotf(detected.x - predicted.x, detected.y - predicted.y);
+  return (dist < limit) ? TRACK_MIN_IOU*(1 - dist/limit) : 0;
+}
+
+
+static void add_event(track_event_t *event, const track_t *track, bool enter, double time)
+{
+  event->track_id = track->id;
+  event->categ    = track->categ;
+  event->enter    = enter;
+  event->prob     = track->prob;
+  event->bbox     = track->bbox;
+  event->duration = enter ? 0 : time - track->first_seen;
+}
+
+
+int tracker_update(tracker_t *t, double time, const detection *dets, int nboxes, int classes,
+                   track_event_t *events)
+{
+  float score[TRACK_MAX][TRACK_MAX];
+  int det[TRACK_MAX], categ[TRACK_MAX];
+  bool det_matched[TRACK_MAX] = {false}, track_matched[TRACK_MAX] = {false};
+  int ndets = 0, nevents = 0, i, j, k;
+
+  // Detections that survived the threshold and suppression, with their most likely class
+  for (i = 0; i < nboxes && ndets < TRACK_MAX; i++) {
+    int best = -1;
+    for (k = 0; k < classes; k++)
+      if (dets[i].prob[k] > 0 && (best < 0 || dets[i].prob[k] > dets[i].prob[best]))
+        best = k;
+    if (best < 0)
+      continue;
+    det[ndets]     = i;
+    categ[ndets++] = best;
+  }
+
+  for (j = 0; j < t->ntracks; j++) {
+    box predicted = track_box(&t->tracks[j], time);
+    for (i = 0; i < ndets; i++)
+      score[j][i] = (categ[i] == t->tracks[j].categ) ? match_score(predicted, dets[det[i]].bbox) : 0;
+  }
+
+  // Greedy assignment, best matches first
+  while (true) {
+    int bj = -1, bi = -1;
+    for (j = 0; j < t->ntracks; j++)
+      for (i = 0; i < ndets; i++)
+        if (!track_matched[j] && !det_matched[i] && score[j][i] > 0 && (bj < 0 || score[j][i] > score[bj][bi])) {
+          bj = j;
+          bi = i;
+        }
+    if (bj < 0)
+      break;
+    track_t *track = &t->tracks[bj];
+    const detection *d = &dets[det[bi]];
+    double dt = time - track->last_seen;
+    if (dt > 0) {
+      // The speed is smoothed over the last detections, as boxes jitter
+      float vx = (d->bbox.x - track->bbox.x)/dt, vy = (d->bbox.y - track->bbox.y)/dt;
+      bool first = (track->last_seen == track->first_seen);
+      track->vx = first ? vx : (track->vx + vx)/2;
+      track->vy = first ? vy : (track->vy + vy)/2;
+    }
+    track->bbox      = d->bbox;
+    track->prob      = d->prob[categ[bi]];
+    track->last_seen = time;
+    track->misses    = 0;
+    track_matched[bj] = det_matched[bi] = true;
+  }
+
+  // Objects missing too often have left; the remaining tracks are compacted
+  for (j = 0, k = 0; j < t->ntracks; j++) {
+    track_t *track = &t->tracks[j];
+    if (!track_matched[j] && ++track->misses >= TRACK_MAX_MISSES) {
+      add_event(&events[nevents++], track, false, time);
+      continue;
+    }
+    t->tracks[k++] = *track;
+  }
+  t->ntracks = k;
+
+  // New objects
+  for (i = 0; i < ndets && t->ntracks < TRACK_MAX; i++) {
+    if (det_matched[i])
+      continue;
+    track_t *track = &t->tracks[t->ntracks++];
+    memset(track, 0, sizeof(*track));
+    track->id         = t->next_id++;
+    track->categ      = categ[i];
+    track->prob       = dets[det[i]].prob[categ[i]];
+    track->bbox       = dets[det[i]].bbox;
+    track->first_seen = track->last_seen = time;
+    add_event(&events[nevents++], track, true, time);
+  }
+
+  return nevents;
+}
+
+
+int tracker_predict(tracker_t *t, double time, detection *dets, int max_boxes, int classes, bool *lost)
+{
+  int j, n = 0;
+
+  *lost = false;
+  for (j = 0; j < t->ntracks && n < max_boxes; j++) {
+    box b = track_box(&t->tracks[j], time);
+    if (b.x < 0 || b.x > 1 || b.y < 0 || b.y > 1) {
+      *lost = true;
+      continue;
+    }
+    detection *d = &dets[n++];
+    d->bbox       = b;
+    d->classes    = classes;
+    d->objectness = t->tracks[j].prob;
+    d->sort_class = t->tracks[j].categ;
+    memset(d->prob, 0, sizeof(float)*classes);
+    d->prob[t->tracks[j].categ] = t->tracks[j].prob;
+  }
+  return n;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef TDS_TRACK_H
+#define TDS_TRACK_H
+
+#include <stdbool.h>
+#include "darknet.h"
+#include "tds.h"
+
+// Lightweight multi-object tracker of a camera. Each detection is matched to the track of the
+// same class whose predicted box overlaps it most (or, failing any overlap, whose centre is
+// nearest), and tracks move at the speed of their last detections. Between detections the
+// tracks stand in for them. The tracks are part of the struct, so there is no allocation per
+// frame.
+#define TRACK_MAX 64         // Objects tracked per camera; further ones are not tracked
+#define TRACK_MIN_IOU 0.3    // Overlap of a detection with a track's predicted box that matches them
+#define TRACK_MAX_SHIFT 2.0  // Otherwise, most distance between their centres, in track sizes
+#define TRACK_MAX_MISSES 2   // Detections in a row that miss an object before it has left
+#define TRACK_MAX_EVENTS (2*TRACK_MAX)  // Events of a detection: objects entering and leaving
+
+typedef struct {
+  int id;
+  int categ;
+  float prob;
+  box bbox;               // Where it was last detected, relative to the frame,
+  float vx;               // how fast it moves (frame widths and heights per second),
+  float vy;
+  double last_seen;       // and when it was last detected
+  double first_seen;
+  int misses;             // Detections in a row it was missing from
+} track_t;
+
+typedef struct {
+  track_t tracks[TRACK_MAX];
+  int ntracks;
+  int next_id;
+} tracker_t;
+
+void tracker_init(tracker_t *t);
+// Matches the detections of a frame captured at time (boxes relative to the frame, suppressed
+// ones with no class) to the tracks. Unmatched detections start tracks, and tracks missing from
+// TRACK_MAX_MISSES detections in a row end. Returns the number of events, which are at most
+// TRACK_MAX_EVENTS
+int  tracker_update(tracker_t *t, double time, const detection *dets, int nboxes, int classes,
+                    track_event_t *events);
+// Fills dets with the boxes of the tracks moved to time. lost is set if a track left the frame
+// meanwhile, so that it is worth detecting again. Returns the number of boxes
+int  tracker_predict(tracker_t *t, double time, detection *dets, int max_boxes, int classes, bool *lost);
+
+#endif
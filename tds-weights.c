@@ -0,0 +1,423 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tds-weights.h"
+
+#define CACHE_MAGIC     "TDSW"
+#define CACHE_VERSION   2
+#define CACHE_EXT       ".tdsw"
+#define CACHE_ALIGN     64     // Alignment of every parameter array (a cache line)
+#define CACHE_DATA_ALIGN 4096  // The arrays start on a page of their own
+#define MAX_TENSORS     5      // Parameter arrays per layer
+#define SHM_PREFIX      "/tds-weights-"
+#define WEIGHTS_SAMPLES 16     // Blocks of the weights file hashed besides its header
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t nlayers;
+  uint32_t reserved;
+  uint64_t file_size;
+  uint64_t weights_size;   // Fingerprint of the weights file the cache was made from,
+  int64_t  weights_mtime;  // (nanoseconds)
+  uint64_t weights_hash;   // (of its header and of sampled blocks)
+  uint64_t cfg_hash;       // and of the model config
+  uint64_t seen;           // Images the network was trained on, as in the weights file
+  uint64_t checksum;       // Of the header (with this field set to 0) and the layer table
+} cache_header_t;
+
+typedef struct {
+  int32_t type;
+  int32_t ntensors;
+  uint64_t count[MAX_TENSORS];   // Floats in each array,
+  uint64_t offset[MAX_TENSORS];  // and where it is in the file
+} cache_layer_t;
+
+
+// The parameter arrays that load_weights() fills in a layer. Returns their number, or -1 for
+// the layers with parameters that the cache does not support
+static int layer_tensors(layer *l, float **tensors[MAX_TENSORS], size_t counts[MAX_TENSORS])
+{
+  int n = 0;
+  size_t bn = 0;
+
+  if (l->dontload)
+    return 0;
+  switch (l->type) {
+    case CONVOLUTIONAL:
+    case DECONVOLUTIONAL:
+      tensors[n] = &l->biases;  counts[n++] = l->n;
+      tensors[n] = &l->weights; counts[n++] = l->nweights;
+      bn = l->n;
+      break;
+    case CONNECTED:
+      tensors[n] = &l->biases;  counts[n++] = l->outputs;
+      tensors[n] = &l->weights; counts[n++] = (size_t)l->outputs*l->inputs;
+      bn = l->outputs;
+      break;
+    case BATCHNORM:
+      tensors[n] = &l->scales;           counts[n++] = l->c;
+      tensors[n] = &l->rolling_mean;     counts[n++] = l->c;
+      tensors[n] = &l->rolling_variance; counts[n++] = l->c;
+      return n;
+    case LOCAL:
+    case RNN:
+    case GRU:
+    case LSTM:
+    case CRNN:
+      return -1;
+    default:
+      return 0;
+  }
+  if (l->batch_normalize && !l->dontloadscales) {
+    tensors[n] = &l->scales;           counts[n++] = bn;
+    tensors[n] = &l->rolling_mean;     counts[n++] = bn;
+    tensors[n] = &l->rolling_variance; counts[n++] = bn;
+  }
+  return n;
+}
+
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  size_t i;
+  for (i = 0; i < len; i++)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+
+static uint64_t header_checksum(cache_header_t header, const cache_layer_t *table)
+{
+  header.checksum = 0;
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, &header, sizeof(header));
+  return fnv1a(hash, table, sizeof(cache_layer_t)*header.nlayers);
+}
+
+
+// Fills the fingerprint of the weights file and of the model config in the header. Weights for
+// a model config all have the same size, and copies keep their modification time (cp -p,
+// rsync -a, tar), so the header of the weights file and blocks spread over it are hashed too
+static int fingerprint(const char *cfgfile, const char *weightfile, cache_header_t *header)
+{
+  struct stat st;
+  char buf[4096];
+  ssize_t n;
+  int i;
+
+  int fd = open(weightfile, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  header->weights_size  = st.st_size;
+  header->weights_mtime = (int64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+  header->weights_hash  = 0xcbf29ce484222325ULL;
+  off_t step = st.st_size > (off_t)sizeof(buf) ? (st.st_size - (off_t)sizeof(buf))/WEIGHTS_SAMPLES : 0;
+  for (i = 0; i <= WEIGHTS_SAMPLES; i++) {
+    if ((n = pread(fd, buf, sizeof(buf), step*i)) < 0) {
+      close(fd);
+      return -1;
+    }
+    header->weights_hash = fnv1a(header->weights_hash, buf, n);
+  }
+  close(fd);
+
+  FILE *f = fopen(cfgfile, "rb");
+  if (f == NULL)
+    return -1;
+  header->cfg_hash = 0xcbf29ce484222325ULL;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    header->cfg_hash = fnv1a(header->cfg_hash, buf, n);
+  fclose(f);
+  return 0;
+}
+
+
+static bool same_fingerprint(const cache_header_t *a, const cache_header_t *b)
+{
+  return a->weights_size == b->weights_size && a->weights_mtime == b->weights_mtime &&
+         a->weights_hash == b->weights_hash && a->cfg_hash == b->cfg_hash;
+}
+
+
+static size_t align_up(size_t x, size_t a)
+{
+  return (x + a - 1)/a*a;
+}
+
+
+// Builds the layer table of net. Returns the size of the cache file, 0 if net cannot be cached
+static size_t layout(network *net, cache_layer_t *table)
+{
+  float **tensors[MAX_TENSORS];
+  size_t counts[MAX_TENSORS];
+  size_t offset = align_up(sizeof(cache_header_t) + sizeof(cache_layer_t)*net->n, CACHE_DATA_ALIGN);
+  int i, k;
+
+  for (i = 0; i < net->n; i++) {
+    int n = layer_tensors(&net->layers[i], tensors, counts);
+    if (n < 0)
+      return 0;
+    memset(&table[i], 0, sizeof(cache_layer_t));
+    table[i].type     = net->layers[i].type;
+    table[i].ntensors = n;
+    for (k = 0; k < n; k++) {
+      table[i].count[k]  = counts[k];
+      table[i].offset[k] = offset;
+      offset = align_up(offset + sizeof(float)*counts[k], CACHE_ALIGN);
+    }
+  }
+  return offset;
+}
+
+
+static void cache_path(const char *weightfile, char *path, size_t len)
+{
+  snprintf(path, len, "%s" CACHE_EXT, weightfile);
+}
+
+
+// The shared memory object is named after the weights file only; the fingerprint is in its
+// header. A change of weights or model config then replaces the object instead of leaving the
+// old copy of the parameters in memory next to the new one
+static void shm_name(const char *weightfile, char *name, size_t len)
+{
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, weightfile, strlen(weightfile));
+  snprintf(name, len, SHM_PREFIX "%016llx", (unsigned long long)hash);
+}
+
+
+// Whether the shared memory object in fd is a complete cache of other weights, a model config
+// or a version of the cache (one still being written has no header yet)
+static bool shm_is_stale(int fd, const cache_header_t *expected)
+{
+  cache_header_t header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || memcmp(header.magic, CACHE_MAGIC, 4) != 0)
+    return false;
+  return header.version != CACHE_VERSION || !same_fingerprint(&header, expected);
+}
+
+
+// Maps the cache in fd and points the layers of net at it, if it matches the network and the
+// expected fingerprint. A shared mapping is read-only
+static int map_cache(network *net, int fd, const char *name, const cache_header_t *expected, bool shared,
+                     weight_cache_t *cache)
+{
+  float **tensors[MAX_TENSORS];
+  size_t counts[MAX_TENSORS];
+  struct stat st;
+  int i, k;
+
+  cache_layer_t *table = malloc(sizeof(cache_layer_t)*net->n);
+  if (table == NULL)
+    return -1;
+  size_t size = layout(net, table);
+  if (size == 0 || fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+    free(table);
+    return -1;
+  }
+  // Either way the pages are those of the page cache (or of the shared memory object), shared
+  // with the other processes mapping the cache. A private mapping would copy the pages that
+  // something writes to; a shared one is read-only, so that they can never be copied
+  void *map = shared ? mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)
+                     : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    free(table);
+    return -1;
+  }
+
+  const cache_header_t *header = map;
+  const cache_layer_t *stored  = (const cache_layer_t *)(header + 1);
+  if (memcmp(header->magic, CACHE_MAGIC, 4) != 0 || header->version != CACHE_VERSION ||
+      header->nlayers != (uint32_t)net->n || header->file_size != size ||
+      !same_fingerprint(header, expected) || header->checksum != header_checksum(*header, stored) ||
+      memcmp(stored, table, sizeof(cache_layer_t)*net->n) != 0) {
+    printf("Weight cache:   %s is out of date or incomplete\n", name);
+    munmap(map, size);
+    free(table);
+    return -1;
+  }
+
+  // The arrays allocated when the network was parsed are replaced by the mapped ones
+  for (i = 0; i < net->n; i++) {
+    int n = layer_tensors(&net->layers[i], tensors, counts);
+    for (k = 0; k < n; k++) {
+      free(*tensors[k]);
+      *tensors[k] = (float *)((char *)map + table[i].offset[k]);
+    }
+  }
+  if (net->seen != NULL)
+    *net->seen = header->seen;
+  // Start reading the file in now, rather than on the first forward pass
+  madvise(map, size, MADV_WILLNEED);
+  free(table);
+
+  cache->map  = map;
+  cache->size = size;
+  printf("Weight cache:   mapped %s (%.1f MB%s)\n", name, size/1e6, shared ? ", shared read-only" : "");
+  return 0;
+}
+
+
+int weight_cache_load(network *net, const char *cfgfile, const char *weightfile, int flags, weight_cache_t *cache)
+{
+  cache_header_t expected = {.version = CACHE_VERSION};
+  char path[1100], name[64];
+  int fd, status = -1;
+
+  if (fingerprint(cfgfile, weightfile, &expected) != 0)
+    return -1;
+  if (flags & WEIGHT_CACHE_FILE) {
+    cache_path(weightfile, path, sizeof(path));
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+      status = map_cache(net, fd, path, &expected, flags & WEIGHT_CACHE_SHARED, cache);
+      close(fd);
+    }
+  }
+  if (status != 0 && (flags & WEIGHT_CACHE_SHARED)) {
+    shm_name(weightfile, name, sizeof(name));
+    if ((fd = shm_open(name, O_RDONLY, 0)) >= 0) {
+      status = map_cache(net, fd, name, &expected, true, cache);
+      close(fd);
+    }
+  }
+  return status;
+}
+
+
+// Writes the cache of net to fd, the header last: until it is complete, the cache is invalid
+static int write_cache(network *net, int fd, const char *cfgfile, const char *weightfile)
+{
+  float **tensors[MAX_TENSORS];
+  size_t counts[MAX_TENSORS];
+  cache_header_t header = {.version = CACHE_VERSION};
+  int i, k;
+
+  cache_layer_t *table = calloc(net->n, sizeof(cache_layer_t));
+  if (table == NULL || fingerprint(cfgfile, weightfile, &header) != 0) {
+    free(table);
+    return -1;
+  }
+  size_t size = layout(net, table);
+  if (size == 0) {
+    printf("Weight cache:   not supported for the layers of %s\n", cfgfile);
+    free(table);
+    return -1;
+  }
+  memcpy(header.magic, CACHE_MAGIC, 4);
+  header.nlayers   = net->n;
+  header.file_size = size;
+  header.seen      = net->seen != NULL ? *net->seen : 0;
+  header.checksum  = header_checksum(header, table);
+
+  int status = ftruncate(fd, size);
+  for (i = 0; i < net->n && status == 0; i++) {
+    int n = layer_tensors(&net->layers[i], tensors, counts);
+    for (k = 0; k < n && status == 0; k++)
+      if (pwrite(fd, *tensors[k], sizeof(float)*counts[k], table[i].offset[k]) != (ssize_t)(sizeof(float)*counts[k]))
+        status = -1;
+  }
+  if (status == 0 && (pwrite(fd, table, sizeof(cache_layer_t)*net->n, sizeof(header)) != (ssize_t)(sizeof(cache_layer_t)*net->n) ||
+                      pwrite(fd, &header, sizeof(header), 0) != sizeof(header)))
+    status = -1;
+  free(table);
+  return status;
+}
+
+
+int weight_cache_save(network *net, const char *cfgfile, const char *weightfile, int flags, weight_cache_t *cache)
+{
+  cache_header_t expected = {.version = CACHE_VERSION};
+  char path[1100], tmp[1200], name[64];
+  int fd, status = -1;
+
+  if (fingerprint(cfgfile, weightfile, &expected) != 0)
+    return -1;
+  if (flags & WEIGHT_CACHE_FILE) {
+    // Written under a temporary name, so that a cache is never seen half written
+    cache_path(weightfile, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) >= 0) {
+      status = write_cache(net, fd, cfgfile, weightfile);
+      if (status == 0 && (flags & WEIGHT_CACHE_SHARED))
+        status = map_cache(net, fd, path, &expected, true, cache);
+      if (close(fd) != 0 || status != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        status = -1;
+      }
+    }
+    if (status == 0)
+      printf("Weight cache:   wrote %s\n", path);
+    else
+      printf("Warning: cannot write the weight cache %s\n", path);
+  }
+  if (status != 0 && (flags & WEIGHT_CACHE_SHARED)) {
+    // No cache file: the first process puts the weights in a shared memory object. One that
+    // finds it still being written keeps its own copy; a stale one is replaced
+    shm_name(weightfile, name, sizeof(name));
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0) {
+      if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+        return -1;
+      bool stale = shm_is_stale(fd, &expected);
+      close(fd);
+      if (!stale)
+        return -1;
+      printf("Weight cache:   replacing %s\n", name);
+      shm_unlink(name);
+      if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0)
+        return -1;
+    }
+    status = write_cache(net, fd, cfgfile, weightfile);
+    if (status == 0)
+      status = map_cache(net, fd, name, &expected, true, cache);
+    else
+      shm_unlink(name);
+    close(fd);
+  }
+  return status;
+}
+
+
+void weight_cache_release(network *net, weight_cache_t *cache)
+{
+  float **tensors[MAX_TENSORS];
+  size_t counts[MAX_TENSORS];
+  int i, k;
+
+  if (cache->map == NULL)
+    return;
+  // free_network() must not free the mapped arrays
+  for (i = 0; i < net->n; i++) {
+    int n = layer_tensors(&net->layers[i], tensors, counts);
+    for (k = 0; k < n; k++)
+      *tensors[k] = NULL;
+  }
+  munmap(cache->map, cache->size);
+  cache->map = NULL;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_WEIGHTS_H
+#define TDS_WEIGHTS_H
+
+#include <stddef.h>
+#include "darknet.h"
+
+// Cache of a network's parameters in a file next to the weights (<weights>.tdsw), written the
+// first time the weights are loaded (when enabled). The parameters are stored in the layout of
+// the loaded network, each array aligned, so that later starts map the file and point the
+// layers at it instead of reading and converting the weights. A cache made from other weights
+// (size, modification time, and a hash of the header and of sampled blocks of the file) or
+// another model config is ignored.
+//
+// With WEIGHT_CACHE_SHARED the cache is mapped read-only and shared, so that the processes on a
+// node that run the same model hold a single copy of its parameters. When there is no cache
+// file (or it cannot be written), the first process puts the cache in a POSIX shared memory
+// object (/dev/shm/tds-weights-*, one per weights file) that the others map. An object left by
+// other weights or another model config is replaced.
+#define WEIGHT_CACHE_FILE   1
+#define WEIGHT_CACHE_SHARED 2
+
+typedef struct {
+  void *map;
+  size_t size;
+} weight_cache_t;
+
+// Points the parameters of net (parsed from cfgfile) at the cache of weightfile. Returns 0 on
+// success, -1 if there is no usable cache; net is then unchanged
+int  weight_cache_load(network *net, const char *cfgfile, const char *weightfile, int flags, weight_cache_t *cache);
+// Writes the cache of the weights loaded into net; the file is replaced atomically. With
+// WEIGHT_CACHE_SHARED, net is then pointed at the shared cache too
+int  weight_cache_save(network *net, const char *cfgfile, const char *weightfile, int flags, weight_cache_t *cache);
+// Detaches net from the cache and unmaps it (before free_network())
+void weight_cache_release(network *net, weight_cache_t *cache);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2021 IBM
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef TDS_H
+#define TDS_H
+
+#include <stdbool.h>
+#include "darknet.h"
+
+// Types shared by the TDS modules
+
+typedef struct {
+  int width;
+  int height;
+  int c;
+} dim_t;
+
+// Frames a camera's decoder may skip instead of decoding them only to drop them when sampling:
+// non-reference frames, everything but keyframes, or keyframes only while the GOP is shorter
+// than the sample interval
+typedef enum {
+  SKIP_NONE,
+  SKIP_NONREF,
+  SKIP_NOKEY,
+  SKIP_AUTO
+} skip_mode_t;
+
+// Rectangle of a frame, in pixels
+typedef struct {
+  int x;
+  int y;
+  int w;
+  int h;
+} region_t;
+
+// An object entering or leaving the view of a tracked camera
+typedef struct {
+  int track_id;
+  int categ;
+  bool enter;
+  float prob;
+  box bbox;               // Where it was first (enter) or last (exit) detected, relative to the frame
+  double duration;        // Exit: seconds it was tracked
+} track_event_t;
+
+struct frame_pool;
+
+// A camera frame travelling through the pipeline (reader -> preprocess -> inference -> output).
+// Frames and all their buffers belong to a per-camera pool and are recycled, never freed.
+typedef struct {
+  struct frame_pool *pool;
+  int cam_id;
+  int width;              // Size of the frame as read (boxes are mapped back to it); cameras may
+  int height;             // differ, and change resolution
+  unsigned char *data;    // Raw rgb24 frame as read from the pipe; grows with the frame size
+  size_t data_size;       // Allocated bytes of data
+  image im;               // Decoded image (image-directory mode); grows with the image size
+  size_t im_size;         // Allocated bytes of im.data
+  const char *name;       // Image file (image-directory mode)
+  image sized;            // Letterboxed network input
+  image *crops;           // Motion-ROI cameras: letterboxed network inputs of the changed regions
+  region_t *regions;      // of the frame at full resolution, where they are in the frame,
+  int max_crops;          // and how many of them there are room for and this frame has (0: the
+  int ncrops;             // whole frame is in sized)
+  detection *dets;        // Preallocated for the largest number of boxes the network can output
+  int max_boxes;
+  int nboxes;
+  bool carried;           // Static scene: not inferred, the camera's last detections carried forward,
+  bool tracked;           // or tracked camera between detections: not inferred, its tracks moved
+  track_event_t *events;  // Tracked cameras: objects that entered or left as this frame was
+  int max_events;         // inferred
+  int nevents;
+  double media_time;      // Offline video: position of the frame in the file (seconds)
+  double capture_time;    // Time the frame was read from its camera
+  double age;             // Time from capture_time to the start of inference
+  double deadline;        // Time by which the frame must be classified (the camera's next sample)
+  int priority;           // Priority of the camera, for frames that are already late
+  double read_time;
+  double conversion_time;
+  double prediction_time;
+  double boxing_time;
+} frame_t;
+
+extern volatile bool exit_loop;
+
+#endif